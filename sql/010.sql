@@ -0,0 +1,4 @@
+ALTER TABLE version ADD COLUMN intver INT UNSIGNED;
+ALTER TABLE version ADD COLUMN intminver INT UNSIGNED;
+
+CREATE INDEX version_plugin_intver ON version (plugin_id, intver);
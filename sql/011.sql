@@ -0,0 +1 @@
+ALTER TABLE version ADD COLUMN arch TEXT;
@@ -0,0 +1 @@
+CREATE INDEX version_pkg_digest ON version (pkg_digest(40));
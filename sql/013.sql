@@ -0,0 +1 @@
+DROP INDEX version_plugin_intver ON version;
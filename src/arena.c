@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+  arena_chunk_t *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+
+/**
+ *
+ */
+void
+arena_init(arena_t *a, size_t chunksize)
+{
+  a->chunks = NULL;
+  a->chunksize = chunksize < 4096 ? 4096 : chunksize;
+  a->maxchunksize = a->chunksize;
+}
+
+
+/**
+ * Let each new chunk be twice the size of the previous one, up to
+ * maxchunksize, for arenas whose final size isn't known up front
+ */
+void
+arena_set_max_chunksize(arena_t *a, size_t maxchunksize)
+{
+  a->maxchunksize = maxchunksize;
+}
+
+
+/**
+ *
+ */
+void *
+arena_alloc(arena_t *a, size_t size)
+{
+  arena_chunk_t *ac = a->chunks;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if(ac == NULL || ac->size - ac->used < size) {
+
+    if(ac != NULL && size > a->chunksize) {
+      // Oversized allocations get a chunk of their own. Keep it behind
+      // the current chunk so the rest of that one isn't abandoned
+      arena_chunk_t *big = malloc(sizeof(arena_chunk_t) + size);
+      if(big == NULL)
+        return NULL;
+      big->size = size;
+      big->used = size;
+      big->next = ac->next;
+      ac->next = big;
+      return big->data;
+    }
+
+    size_t chunksize = size > a->chunksize ? size : a->chunksize;
+    ac = malloc(sizeof(arena_chunk_t) + chunksize);
+    if(ac == NULL)
+      return NULL;
+    ac->size = chunksize;
+    ac->used = 0;
+    ac->next = a->chunks;
+    a->chunks = ac;
+
+    if(a->chunksize < a->maxchunksize)
+      a->chunksize = a->chunksize * 2 < a->maxchunksize ?
+        a->chunksize * 2 : a->maxchunksize;
+  }
+
+  void *r = ac->data + ac->used;
+  ac->used += size;
+  return r;
+}
+
+
+/**
+ *
+ */
+void *
+arena_zalloc(arena_t *a, size_t size)
+{
+  void *r = arena_alloc(a, size);
+  if(r != NULL)
+    memset(r, 0, size);
+  return r;
+}
+
+
+/**
+ *
+ */
+char *
+arena_strdup(arena_t *a, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char *r = arena_alloc(a, len);
+  if(r != NULL)
+    memcpy(r, str, len);
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+arena_destroy(arena_t *a)
+{
+  arena_chunk_t *ac, *next;
+  for(ac = a->chunks; ac != NULL; ac = next) {
+    next = ac->next;
+    free(ac);
+  }
+  a->chunks = NULL;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+/**
+ * Bump allocator. Everything allocated is released at once by
+ * arena_destroy()
+ */
+typedef struct arena {
+  arena_chunk_t *chunks;
+  size_t chunksize;
+  size_t maxchunksize;
+} arena_t;
+
+void arena_init(arena_t *a, size_t chunksize);
+
+void arena_set_max_chunksize(arena_t *a, size_t maxchunksize);
+
+void *arena_alloc(arena_t *a, size_t size);
+
+void *arena_zalloc(arena_t *a, size_t size);
+
+char *arena_strdup(arena_t *a, const char *str);
+
+void arena_destroy(arena_t *a);
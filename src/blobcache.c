@@ -0,0 +1,230 @@
+#include <sys/queue.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/cmd.h"
+
+#include "blobcache.h"
+#include "spmc.h"
+
+/**
+ * LRU cache of small stash objects (mostly icons). Objects are content
+ * addressed and thus never change, so entries are only ever evicted,
+ * never invalidated
+ */
+#define BLOBCACHE_HASH_SIZE 256
+
+LIST_HEAD(cached_blob_list, cached_blob);
+TAILQ_HEAD(cached_blob_queue, cached_blob);
+
+typedef struct cached_blob {
+  blob_t blob;  // Must be first
+  LIST_ENTRY(cached_blob) hash_link;
+  TAILQ_ENTRY(cached_blob) lru_link;
+  uint32_t hash;
+  char digest[41];
+} cached_blob_t;
+
+static pthread_mutex_t blobcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_blob_list blobcache_hash[BLOBCACHE_HASH_SIZE];
+static struct cached_blob_queue blobcache_lru =
+  TAILQ_HEAD_INITIALIZER(blobcache_lru);
+static size_t blobcache_bytes;
+static int blobcache_entries;
+
+static unsigned int blobcache_hits;
+static unsigned int blobcache_misses;
+static unsigned int blobcache_bypasses;
+static unsigned int blobcache_evictions;
+
+
+/**
+ *
+ */
+void
+blob_release(blob_t *b)
+{
+  if(__sync_sub_and_fetch(&b->refcount, 1))
+    return;
+  free(b);
+}
+
+
+/**
+ *
+ */
+static cached_blob_t *
+blobcache_find(const char *digest, uint32_t hash)
+{
+  cached_blob_t *cb;
+  LIST_FOREACH(cb, &blobcache_hash[hash % BLOBCACHE_HASH_SIZE], hash_link)
+    if(cb->hash == hash && !strcmp(cb->digest, digest))
+      return cb;
+  return NULL;
+}
+
+
+/**
+ * Return a reference to a cached object or NULL. Counts as a miss
+ * in the latter case, callers are expected to try blobcache_load().
+ * 'size' is the object size if known, otherwise -1
+ */
+blob_t *
+blobcache_get(const char *digest, int64_t size)
+{
+  cfg_root(root);
+  const int64_t maxobject =
+    cfg_get_int(root, CFG("stash", "cacheobjectmax"), 65536);
+  const uint32_t hash = strhash(digest);
+  cached_blob_t *cb;
+
+  pthread_mutex_lock(&blobcache_mutex);
+
+  // Objects that can never be cached should not count as misses
+  if(size > maxobject) {
+    blobcache_bypasses++;
+    pthread_mutex_unlock(&blobcache_mutex);
+    return NULL;
+  }
+
+  cb = blobcache_find(digest, hash);
+  if(cb != NULL) {
+    TAILQ_REMOVE(&blobcache_lru, cb, lru_link);
+    TAILQ_INSERT_HEAD(&blobcache_lru, cb, lru_link);
+    __sync_add_and_fetch(&cb->blob.refcount, 1);
+    blobcache_hits++;
+  } else {
+    blobcache_misses++;
+  }
+  pthread_mutex_unlock(&blobcache_mutex);
+  return cb != NULL ? &cb->blob : NULL;
+}
+
+
+/**
+ *
+ */
+static void
+blobcache_unlink(cached_blob_t *cb)
+{
+  LIST_REMOVE(cb, hash_link);
+  TAILQ_REMOVE(&blobcache_lru, cb, lru_link);
+  blobcache_bytes -= cb->blob.size;
+  blobcache_entries--;
+  blob_release(&cb->blob);
+}
+
+
+/**
+ * Read an object from 'fd' and add it to the cache. Returns NULL if
+ * the object is too big to be cached, the caller should send it from
+ * the file instead
+ */
+blob_t *
+blobcache_load(const char *digest, int fd, size_t size)
+{
+  cfg_root(root);
+  const size_t budget =
+    cfg_get_int(root, CFG("stash", "cachesize"), 16 * 1024 * 1024);
+  const size_t maxobject =
+    cfg_get_int(root, CFG("stash", "cacheobjectmax"), 65536);
+
+  if(size > maxobject || size > budget)
+    return NULL;
+
+  cached_blob_t *cb = malloc(sizeof(cached_blob_t) + size);
+  cb->blob.data = (uint8_t *)(cb + 1);
+  cb->blob.size = size;
+  cb->blob.refcount = 1;
+
+  size_t off = 0;
+  while(off < size) {
+    ssize_t r = pread(fd, cb->blob.data + off, size - off, off);
+    if(r == -1 && errno == EINTR)
+      continue;
+    if(r <= 0) {
+      trace(LOG_ERR, "Unable to read stash object %s -- %s",
+            digest, r ? strerror(errno) : "Short file");
+      free(cb);
+      return NULL;
+    }
+    off += r;
+  }
+
+  snprintf(cb->digest, sizeof(cb->digest), "%s", digest);
+  cb->hash = strhash(cb->digest);
+
+  pthread_mutex_lock(&blobcache_mutex);
+
+  cached_blob_t *old = blobcache_find(cb->digest, cb->hash);
+  if(old != NULL) {
+    // Someone else loaded it while we were reading, use theirs
+    __sync_add_and_fetch(&old->blob.refcount, 1);
+    pthread_mutex_unlock(&blobcache_mutex);
+    free(cb);
+    return &old->blob;
+  }
+
+  cb->blob.refcount++;
+  LIST_INSERT_HEAD(&blobcache_hash[cb->hash % BLOBCACHE_HASH_SIZE], cb,
+                   hash_link);
+  TAILQ_INSERT_HEAD(&blobcache_lru, cb, lru_link);
+  blobcache_bytes += size;
+  blobcache_entries++;
+
+  while(blobcache_bytes > budget &&
+        (old = TAILQ_LAST(&blobcache_lru, cached_blob_queue)) != cb) {
+    blobcache_unlink(old);
+    blobcache_evictions++;
+  }
+
+  pthread_mutex_unlock(&blobcache_mutex);
+  return &cb->blob;
+}
+
+
+/**
+ * Drop an object, for when it is deleted or found to be corrupt
+ */
+void
+blobcache_remove(const char *digest)
+{
+  pthread_mutex_lock(&blobcache_mutex);
+  cached_blob_t *cb = blobcache_find(digest, strhash(digest));
+  if(cb != NULL)
+    blobcache_unlink(cb);
+  pthread_mutex_unlock(&blobcache_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+show_stash_cache(const char *user,
+                 int argc, const char **argv, int *intv,
+                 void (*msg)(void *opaque, const char *fmt, ...),
+                 void *opaque)
+{
+  pthread_mutex_lock(&blobcache_mutex);
+  msg(opaque, "%d objects, %zd bytes", blobcache_entries, blobcache_bytes);
+  msg(opaque, "%u hits, %u misses, %u evictions, %u too big to cache",
+      blobcache_hits, blobcache_misses, blobcache_evictions,
+      blobcache_bypasses);
+  pthread_mutex_unlock(&blobcache_mutex);
+  return 0;
+}
+
+CMD(show_stash_cache,
+    CMD_LITERAL("show"),
+    CMD_LITERAL("stash"),
+    CMD_LITERAL("cache")
+    );
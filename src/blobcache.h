@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An immutable stash object held in memory
+ */
+typedef struct blob {
+  int refcount;
+  size_t size;
+  uint8_t *data;
+} blob_t;
+
+blob_t *blobcache_get(const char *digest, int64_t size);
+
+blob_t *blobcache_load(const char *digest, int fd, size_t size);
+
+void blob_release(blob_t *b);
+
+void blobcache_remove(const char *digest);
@@ -0,0 +1,511 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <openssl/sha.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/db.h"
+
+#include "catalog.h"
+#include "sql_statements.h"
+#include "spmc.h"
+
+// Pending versions with more downloads than this are no longer beta
+#define CATALOG_BETA_MAX_DOWNLOADS 5000
+
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t catalog_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static catalog_t *catalog_current;
+static uint32_t catalog_generation;
+
+// Bumped by catalog_invalidate(), compared against what we loaded from
+static unsigned int catalog_stamp;
+static unsigned int catalog_loaded_stamp;
+
+
+/**
+ *
+ */
+static void
+catalog_destroy(catalog_t *cat)
+{
+  for(int i = 0; i < cat->num_versions; i++) {
+    catalog_version_t *cv = &cat->versions[i];
+    free((void *)cv->id);
+    free((void *)cv->version);
+    free((void *)cv->type);
+    free((void *)cv->author);
+    free((void *)cv->showtime_min_version);
+    free((void *)cv->title);
+    free((void *)cv->category);
+    free((void *)cv->synopsis);
+    free((void *)cv->description);
+    free((void *)cv->homepage);
+    free((void *)cv->pkg_digest);
+    free((void *)cv->icon_digest);
+    free((void *)cv->betasecret);
+    free((void *)cv->arch);
+    free((void *)cv->regions);
+  }
+  for(int i = 0; i < cat->num_archs; i++)
+    free((void *)cat->archs[i]);
+  free(cat->archs);
+  for(int i = 0; i < cat->num_regions; i++)
+    free((void *)cat->regions[i]);
+  free(cat->regions);
+  free(cat->versions);
+  free(cat->plugins);
+  free(cat->rejected);
+  free(cat->minvers);
+  free(cat);
+}
+
+
+/**
+ *
+ */
+void
+catalog_release(catalog_t *cat)
+{
+  if(cat == NULL)
+    return;
+  if(__sync_sub_and_fetch(&cat->refcount, 1))
+    return;
+  catalog_destroy(cat);
+}
+
+
+/**
+ *
+ */
+static const char *
+catalog_strdup(SHA_CTX *ctx, const char *str)
+{
+  SHA1_Update(ctx, str, strlen(str) + 1);
+  return strdup(str);
+}
+
+
+/**
+ *
+ */
+static int
+u32_cmp(const void *A, const void *B)
+{
+  const uint32_t a = *(const uint32_t *)A;
+  const uint32_t b = *(const uint32_t *)B;
+  return a < b ? -1 : a > b;
+}
+
+
+/**
+ *
+ */
+static const char *
+token_find(const char **tokens, int num_tokens, const char *str)
+{
+  if(str == NULL)
+    return NULL;
+
+  for(int i = 0; i < num_tokens; i++)
+    if(!strcmp(tokens[i], str))
+      return tokens[i];
+  return NULL;
+}
+
+
+/**
+ * Add the elements of a comma separated list not seen before to 'tokens'
+ */
+static void
+token_collect(const char ***tokens, int *num_tokens, const char *csv)
+{
+  while(*csv) {
+    const size_t len = strcspn(csv, ",");
+    char *tok = strndup(csv, len);
+    if(len > 0 && token_find(*tokens, *num_tokens, tok) == NULL) {
+      *tokens = realloc(*tokens, (*num_tokens + 1) * sizeof(const char *));
+      (*tokens)[(*num_tokens)++] = tok;
+    } else {
+      free(tok);
+    }
+    csv += len;
+    if(*csv == ',')
+      csv++;
+  }
+}
+
+
+/**
+ * Build the per-plugin, rejected and min-version indices. Rows arrive
+ * ordered by plugin id in byte order (not the column's case insensitive
+ * collation) so each plugin's versions are contiguous
+ */
+static void
+catalog_index(catalog_t *cat)
+{
+  const int n = cat->num_versions;
+  catalog_plugin_t *cp = NULL;
+  int j;
+
+  cat->plugins  = malloc((n + 1) * sizeof(catalog_plugin_t));
+  cat->rejected = malloc((n + 1) * sizeof(catalog_version_t *));
+  cat->minvers  = malloc((n + 1) * sizeof(uint32_t));
+
+  for(int i = 0; i < n; i++) {
+    const catalog_version_t *cv = &cat->versions[i];
+
+    if(cp == NULL || strcmp(cp->id, cv->id)) {
+      cp = &cat->plugins[cat->num_plugins++];
+      cp->id            = cv->id;
+      cp->betasecret    = cv->betasecret;
+      cp->first_version = i;
+      cp->num_versions  = 0;
+    }
+    cp->num_versions++;
+
+    if(cv->status == 'r')
+      cat->rejected[cat->num_rejected++] = cv;
+
+    cat->minvers[i] = cv->intminver;
+
+    token_collect(&cat->archs, &cat->num_archs, cv->arch);
+    token_collect(&cat->regions, &cat->num_regions, cv->regions);
+  }
+
+  qsort(cat->minvers, n, sizeof(uint32_t), u32_cmp);
+  j = 0;
+  for(int i = 0; i < n; i++)
+    if(j == 0 || cat->minvers[j - 1] != cat->minvers[i])
+      cat->minvers[j++] = cat->minvers[i];
+  cat->num_minvers = j;
+}
+
+
+/**
+ * Map a client version to the number of distinct minimum versions it
+ * satisfies. Clients in the same bucket see exactly the same catalog.
+ */
+int
+catalog_version_bucket(const catalog_t *cat, uint32_t reqversion)
+{
+  int lo = 0, hi = cat->num_minvers;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(cat->minvers[mid] <= reqversion)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+/**
+ * Clients whose architecture no plugin is restricted to all see the
+ * same catalog. Returns the architecture to key cached responses on,
+ * or NULL for the shared bucket
+ */
+const char *
+catalog_arch_bucket(const catalog_t *cat, const char *arch)
+{
+  return token_find(cat->archs, cat->num_archs, arch);
+}
+
+
+/**
+ * Same as catalog_arch_bucket() but for the client's country
+ */
+const char *
+catalog_region_bucket(const catalog_t *cat, const char *region)
+{
+  return token_find(cat->regions, cat->num_regions, region);
+}
+
+
+/**
+ *
+ */
+static catalog_t *
+catalog_load(void)
+{
+  db_conn_t *c = db_get_conn();
+  if(c == NULL)
+    return NULL;
+
+  db_stmt_t *s = db_stmt_get(c, SQL_GET_ALL);
+
+  if(db_stmt_exec(s, ""))
+    return NULL;
+
+  catalog_t *cat = calloc(1, sizeof(catalog_t));
+  int capacity = 0;
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+
+  while(1) {
+
+    time_t created;
+    char id[128];
+    char version[64];
+    char type[64];
+    char author[128];
+    char showtime_min_version[64];
+    int downloads;
+    char title[256];
+    char category[64];
+    char synopsis[256];
+    char description[4096];
+    char homepage[256];
+    char pkg_digest[64];
+    char icon_digest[64];
+    int published;
+    char comment[4096];
+    char status[8];
+    char betasecret[64];
+    int intver;
+    int intminver;
+    char arch[256];
+    char regions[1024];
+
+    int r = db_stream_row(0, s,
+                          DB_RESULT_STRING(id),
+                          DB_RESULT_TIME(created),
+                          DB_RESULT_STRING(version),
+                          DB_RESULT_STRING(type),
+                          DB_RESULT_STRING(author),
+                          DB_RESULT_INT(downloads),
+                          DB_RESULT_STRING(showtime_min_version),
+                          DB_RESULT_STRING(title),
+                          DB_RESULT_STRING(category),
+                          DB_RESULT_STRING(synopsis),
+                          DB_RESULT_STRING(description),
+                          DB_RESULT_STRING(homepage),
+                          DB_RESULT_STRING(pkg_digest),
+                          DB_RESULT_STRING(icon_digest),
+                          DB_RESULT_INT(published),
+                          DB_RESULT_STRING(comment),
+                          DB_RESULT_STRING(status),
+                          DB_RESULT_STRING(betasecret),
+                          DB_RESULT_INT(intver),
+                          DB_RESULT_INT(intminver),
+                          DB_RESULT_STRING(arch),
+                          DB_RESULT_STRING(regions)
+                          );
+    if(r < 0) {
+      catalog_destroy(cat);
+      return NULL;
+    }
+    if(r)
+      break;
+
+    if(cat->num_versions == capacity) {
+      capacity = capacity * 2 + 64;
+      cat->versions = realloc(cat->versions,
+                              capacity * sizeof(catalog_version_t));
+    }
+
+    catalog_version_t *cv = &cat->versions[cat->num_versions++];
+
+    cv->id                   = catalog_strdup(&ctx, id);
+    cv->version              = catalog_strdup(&ctx, version);
+    cv->type                 = catalog_strdup(&ctx, type);
+    cv->author               = catalog_strdup(&ctx, author);
+    cv->showtime_min_version = catalog_strdup(&ctx, showtime_min_version);
+    cv->title                = catalog_strdup(&ctx, title);
+    cv->category             = catalog_strdup(&ctx, category);
+    cv->synopsis             = catalog_strdup(&ctx, synopsis);
+    cv->description          = catalog_strdup(&ctx, description);
+    cv->homepage             = catalog_strdup(&ctx, homepage);
+    cv->pkg_digest           = catalog_strdup(&ctx, pkg_digest);
+    cv->icon_digest          = catalog_strdup(&ctx, icon_digest);
+    cv->betasecret           = catalog_strdup(&ctx, betasecret);
+    cv->arch                 = catalog_strdup(&ctx, arch);
+    cv->regions              = catalog_strdup(&ctx, regions);
+
+    cv->intver    = intver;
+    cv->intminver = intminver;
+    cv->status    = *status;
+    cv->published = !!published;
+    cv->popular   = downloads >= CATALOG_BETA_MAX_DOWNLOADS;
+
+    SHA1_Update(&ctx, &cv->status, 3);
+  }
+
+  SHA1_Final(cat->fingerprint, &ctx);
+  catalog_index(cat);
+  cat->refcount = 1;
+  cat->loaded = time(NULL);
+  return cat;
+}
+
+
+/**
+ * Return a reference to the current catalog snapshot, reloading it
+ * from the database first if it has been invalidated or is too old.
+ *
+ * The returned snapshot must be released with catalog_release()
+ */
+catalog_t *
+catalog_get(void)
+{
+  catalog_t *cat;
+  cfg_root(root);
+  const int maxage = cfg_get_int(root, CFG("catalog", "maxage"), 300);
+
+  pthread_mutex_lock(&catalog_mutex);
+  cat = catalog_current;
+  if(cat != NULL && catalog_loaded_stamp == catalog_stamp &&
+     time(NULL) < cat->loaded + maxage) {
+    __sync_add_and_fetch(&cat->refcount, 1);
+    pthread_mutex_unlock(&catalog_mutex);
+    return cat;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+
+  pthread_mutex_lock(&catalog_load_mutex);
+
+  // Someone else might have reloaded while we waited for the load lock
+  pthread_mutex_lock(&catalog_mutex);
+  cat = catalog_current;
+  const unsigned int stamp = catalog_stamp;
+  if(cat != NULL && catalog_loaded_stamp == stamp &&
+     time(NULL) < cat->loaded + maxage) {
+    __sync_add_and_fetch(&cat->refcount, 1);
+    pthread_mutex_unlock(&catalog_mutex);
+    pthread_mutex_unlock(&catalog_load_mutex);
+    return cat;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+
+  catalog_t *fresh = catalog_load();
+
+  pthread_mutex_lock(&catalog_mutex);
+
+  if(fresh == NULL) {
+    trace(LOG_ERR, "Unable to load plugin catalog from database");
+  } else if(catalog_current != NULL &&
+            !memcmp(catalog_current->fingerprint, fresh->fingerprint, 20)) {
+    // Nothing changed, keep generation (and thus any ETags) stable
+    catalog_current->loaded = fresh->loaded;
+    catalog_loaded_stamp = stamp;
+    catalog_destroy(fresh);
+  } else {
+    fresh->generation = ++catalog_generation;
+    catalog_release(catalog_current);
+    catalog_current = fresh;
+    catalog_loaded_stamp = stamp;
+    trace(LOG_DEBUG, "Plugin catalog generation %u loaded, %d versions",
+          fresh->generation, fresh->num_versions);
+  }
+
+  cat = catalog_current;
+  if(cat != NULL)
+    __sync_add_and_fetch(&cat->refcount, 1);
+
+  pthread_mutex_unlock(&catalog_mutex);
+  pthread_mutex_unlock(&catalog_load_mutex);
+  return cat;
+}
+
+
+/**
+ * Must be called whenever the version or plugin tables are modified
+ */
+void
+catalog_invalidate(void)
+{
+  pthread_mutex_lock(&catalog_mutex);
+  catalog_stamp++;
+  pthread_mutex_unlock(&catalog_mutex);
+}
+
+
+/**
+ * Fill in integer version columns for rows ingested before they
+ * existed. Uses parse_version_int() so the result is identical to
+ * what ingest stores for new rows.
+ */
+static void
+catalog_backfill(void)
+{
+  typedef struct backfill_row {
+    char id[128];
+    char version[64];
+    char showtime_min_version[64];
+  } backfill_row_t;
+
+  backfill_row_t *rows = NULL;
+  int num_rows = 0, capacity = 0;
+
+  db_conn_t *c = db_get_conn();
+  if(c == NULL)
+    return;
+
+  db_stmt_t *s = db_stmt_get(c, SQL_GET_UNINDEXED_VERSIONS);
+  if(db_stmt_exec(s, ""))
+    return;
+
+  while(1) {
+    if(num_rows == capacity) {
+      capacity = capacity * 2 + 64;
+      rows = realloc(rows, capacity * sizeof(backfill_row_t));
+    }
+    backfill_row_t *br = &rows[num_rows];
+
+    int r = db_stream_row(0, s,
+                          DB_RESULT_STRING(br->id),
+                          DB_RESULT_STRING(br->version),
+                          DB_RESULT_STRING(br->showtime_min_version));
+    if(r)
+      break;
+    num_rows++;
+  }
+
+  if(num_rows > 0) {
+    trace(LOG_INFO, "Computing integer versions for %d plugin versions",
+          num_rows);
+
+    if(db_begin(c)) {
+      trace(LOG_ERR, "Unable to start transaction for integer versions");
+      free(rows);
+      return;
+    }
+
+    s = db_stmt_get(c, SQL_SET_VERSION_INTS);
+    int i;
+    for(i = 0; i < num_rows; i++) {
+      const backfill_row_t *br = &rows[i];
+      if(db_stmt_exec(s, "iiss",
+                      parse_version_int(br->version),
+                      parse_version_int(br->showtime_min_version),
+                      br->id, br->version)) {
+        trace(LOG_ERR, "Unable to store integer versions for %s %s",
+              br->id, br->version);
+        break;
+      }
+    }
+
+    if(i == num_rows)
+      db_commit(c);
+    else
+      db_rollback(c);
+  }
+  free(rows);
+}
+
+
+/**
+ *
+ */
+void
+catalog_init(void)
+{
+  catalog_backfill();
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * One row of the version/plugin join as seen by the device catalog
+ */
+typedef struct catalog_version {
+  const char *id;
+  const char *version;
+  const char *type;
+  const char *author;
+  const char *showtime_min_version;
+  const char *title;
+  const char *category;
+  const char *synopsis;
+  const char *description;
+  const char *homepage;
+  const char *pkg_digest;
+  const char *icon_digest;
+  const char *betasecret;
+  const char *arch;     // Comma separated, empty if not restricted
+  const char *regions;  // Comma separated country codes, likewise
+
+  uint32_t intver;
+  uint32_t intminver;
+
+  char status;
+  char published;
+  char popular;   // Too many downloads to be offered as beta
+
+} catalog_version_t;
+
+
+/**
+ * Distinct plugins in a snapshot, sorted by id in byte order, the same
+ * order as strcmp(). Their versions are
+ * versions[first_version] .. versions[first_version + num_versions - 1]
+ */
+typedef struct catalog_plugin {
+  const char *id;
+  const char *betasecret;
+  int first_version;
+  int num_versions;
+} catalog_plugin_t;
+
+
+/**
+ * Immutable snapshot of all plugin versions, grouped by plugin with
+ * the highest version first. Rows with equal versions are oldest first
+ */
+typedef struct catalog {
+  int refcount;
+  uint32_t generation;
+  time_t loaded;
+  uint8_t fingerprint[20];
+
+  int num_versions;
+  catalog_version_t *versions;
+
+  int num_plugins;
+  catalog_plugin_t *plugins;
+
+  int num_rejected;
+  const catalog_version_t **rejected;
+
+  // Distinct architectures plugins are restricted to
+  int num_archs;
+  const char **archs;
+
+  // Distinct regions plugins are restricted to
+  int num_regions;
+  const char **regions;
+
+  // Sorted distinct showtime_min_version values
+  int num_minvers;
+  uint32_t *minvers;
+
+} catalog_t;
+
+void catalog_init(void);
+
+catalog_t *catalog_get(void);
+
+void catalog_release(catalog_t *cat);
+
+void catalog_invalidate(void);
+
+int catalog_version_bucket(const catalog_t *cat, uint32_t reqversion);
+
+const char *catalog_arch_bucket(const catalog_t *cat, const char *arch);
+
+const char *catalog_region_bucket(const catalog_t *cat, const char *region);
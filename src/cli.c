@@ -11,6 +11,7 @@
 #include "libsvc/cmd.h"
 
 #include "cli.h"
+#include "catalog.h"
 
 #include "sql_statements.h"
 
@@ -170,8 +171,10 @@ delete_plugin(const char *user,
     msg(opaque, "Database query problems");
     return 0;
   }
-  if(db_stmt_affected_rows(s))
+  if(db_stmt_affected_rows(s)) {
     trace(LOG_NOTICE, "User '%s' deleted %s %s", user, argv[0], argv[1]);
+    catalog_invalidate();
+  }
   msg(opaque, "OK, %d rows deleted", db_stmt_affected_rows(s));
   return 0;
 }
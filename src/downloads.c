@@ -0,0 +1,234 @@
+#include <sys/queue.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/db.h"
+
+#include "downloads.h"
+#include "spmc.h"
+
+/**
+ * Download counts are accumulated in memory and added to the version
+ * table by a background thread. Counters are sharded on the digest
+ * hash so concurrent downloads rarely contend for the same lock.
+ */
+#define DL_SHARDS  16
+#define DL_BUCKETS 64
+
+// Max number of digests updated by a single statement
+#define DL_BATCH   500
+
+LIST_HEAD(dl_counter_list, dl_counter);
+
+typedef struct dl_counter {
+  LIST_ENTRY(dl_counter) link;
+  int count;
+  char digest[41];
+} dl_counter_t;
+
+typedef struct dl_shard {
+  pthread_mutex_t mutex;
+  struct dl_counter_list buckets[DL_BUCKETS];
+} dl_shard_t;
+
+static dl_shard_t dl_shards[DL_SHARDS];
+
+static pthread_mutex_t dl_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dl_flush_cond = PTHREAD_COND_INITIALIZER;
+static int dl_running;
+static pthread_t dl_tid;
+
+
+/**
+ *
+ */
+static void
+dl_add(const char *digest, int count)
+{
+  const uint32_t hash = strhash(digest);
+  dl_shard_t *ds = &dl_shards[hash % DL_SHARDS];
+  struct dl_counter_list *bucket = &ds->buckets[(hash / DL_SHARDS) % DL_BUCKETS];
+  dl_counter_t *dc;
+
+  pthread_mutex_lock(&ds->mutex);
+
+  LIST_FOREACH(dc, bucket, link)
+    if(!strcmp(dc->digest, digest))
+      break;
+
+  if(dc == NULL) {
+    dc = malloc(sizeof(dl_counter_t));
+    dc->count = 0;
+    memcpy(dc->digest, digest, sizeof(dc->digest));
+    LIST_INSERT_HEAD(bucket, dc, link);
+  }
+  dc->count += count;
+
+  pthread_mutex_unlock(&ds->mutex);
+}
+
+
+/**
+ * Count a download of 'digest'. Never touches the database
+ */
+void
+downloads_inc(const char *digest)
+{
+  // The digest ends up verbatim in SQL so make sure it's plain hex
+  if(strlen(digest) != 40 ||
+     strspn(digest, "0123456789abcdef") != 40)
+    return;
+  dl_add(digest, 1);
+}
+
+
+/**
+ *
+ */
+static int
+dl_write_batch(dl_counter_t **batch, int num)
+{
+  char *sql = NULL;
+  size_t sqllen = 0;
+  FILE *f = open_memstream(&sql, &sqllen);
+
+  fprintf(f, "UPDATE version SET downloads = downloads + CASE pkg_digest");
+  for(int i = 0; i < num; i++)
+    fprintf(f, " WHEN '%s' THEN %d", batch[i]->digest, batch[i]->count);
+  fprintf(f, " ELSE 0 END WHERE pkg_digest IN (");
+  for(int i = 0; i < num; i++)
+    fprintf(f, "%s'%s'", i ? "," : "", batch[i]->digest);
+  fprintf(f, ")");
+  fclose(f);
+
+  int r;
+  {
+    scoped_db_stmt(s, sql);
+    r = s == NULL || db_stmt_exec(s, "");
+  }
+  free(sql);
+  return r;
+}
+
+
+/**
+ * Move all pending counts to the database. Counts that could not be
+ * written are put back and retried on the next flush
+ */
+static void
+dl_flush(void)
+{
+  struct dl_counter_list pending;
+  dl_counter_t *dc, *batch[DL_BATCH];
+  int num = 0, total = 0;
+
+  LIST_INIT(&pending);
+
+  for(int i = 0; i < DL_SHARDS; i++) {
+    dl_shard_t *ds = &dl_shards[i];
+    pthread_mutex_lock(&ds->mutex);
+    for(int j = 0; j < DL_BUCKETS; j++) {
+      while((dc = LIST_FIRST(&ds->buckets[j])) != NULL) {
+        LIST_REMOVE(dc, link);
+        LIST_INSERT_HEAD(&pending, dc, link);
+      }
+    }
+    pthread_mutex_unlock(&ds->mutex);
+  }
+
+  if(LIST_FIRST(&pending) == NULL)
+    return;
+
+  while((dc = LIST_FIRST(&pending)) != NULL) {
+    LIST_REMOVE(dc, link);
+    batch[num++] = dc;
+
+    if(num < DL_BATCH && LIST_FIRST(&pending) != NULL)
+      continue;
+
+    if(dl_write_batch(batch, num)) {
+      trace(LOG_ERR, "Unable to update download counters, will retry");
+      for(int i = 0; i < num; i++)
+        dl_add(batch[i]->digest, batch[i]->count);
+    } else {
+      for(int i = 0; i < num; i++)
+        total += batch[i]->count;
+    }
+
+    for(int i = 0; i < num; i++)
+      free(batch[i]);
+    num = 0;
+  }
+
+  trace(LOG_DEBUG, "Flushed %d downloads to database", total);
+}
+
+
+/**
+ *
+ */
+static void *
+dl_flush_thread(void *aux)
+{
+  cfg_root(root);
+  struct timespec ts;
+
+  pthread_mutex_lock(&dl_flush_mutex);
+  while(dl_running) {
+    const int interval =
+      cfg_get_int(root, CFG("downloads", "flushinterval"), 5);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += interval > 0 ? interval : 1;
+
+    while(dl_running &&
+          pthread_cond_timedwait(&dl_flush_cond, &dl_flush_mutex,
+                                 &ts) != ETIMEDOUT) {}
+
+    pthread_mutex_unlock(&dl_flush_mutex);
+    dl_flush();
+    pthread_mutex_lock(&dl_flush_mutex);
+  }
+  pthread_mutex_unlock(&dl_flush_mutex);
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+downloads_init(void)
+{
+  for(int i = 0; i < DL_SHARDS; i++) {
+    pthread_mutex_init(&dl_shards[i].mutex, NULL);
+    for(int j = 0; j < DL_BUCKETS; j++)
+      LIST_INIT(&dl_shards[i].buckets[j]);
+  }
+
+  dl_running = 1;
+  pthread_create(&dl_tid, NULL, dl_flush_thread, NULL);
+}
+
+
+/**
+ * Stop the flush thread, it writes whatever is pending before exiting
+ */
+void
+downloads_fini(void)
+{
+  pthread_mutex_lock(&dl_flush_mutex);
+  dl_running = 0;
+  pthread_cond_signal(&dl_flush_cond);
+  pthread_mutex_unlock(&dl_flush_mutex);
+
+  pthread_join(dl_tid, NULL);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+void downloads_inc(const char *digest);
+
+void downloads_init(void);
+
+void downloads_fini(void);
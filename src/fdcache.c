@@ -0,0 +1,235 @@
+#include <sys/queue.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/cmd.h"
+
+#include "fdcache.h"
+#include "spmc.h"
+
+/**
+ * Bounded LRU of open stash objects so popular packages don't cost an
+ * open() and fstat() per download. Evicted fds are closed once the
+ * last download using them finishes. A few idle fds are kept per
+ * object so concurrent downloads of it rarely need to open() another
+ */
+#define FDCACHE_HASH_SIZE 256
+
+LIST_HEAD(cached_file_list, cached_file);
+TAILQ_HEAD(cached_file_queue, cached_file);
+
+typedef struct cached_file {
+  stash_file_t sf;  // Must be first
+  LIST_ENTRY(cached_file) hash_link;
+  TAILQ_ENTRY(cached_file) lru_link;
+  uint32_t hash;
+  char digest[41];
+} cached_file_t;
+
+static pthread_mutex_t fdcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_file_list fdcache_hash[FDCACHE_HASH_SIZE];
+static struct cached_file_queue fdcache_lru =
+  TAILQ_HEAD_INITIALIZER(fdcache_lru);
+static int fdcache_entries;
+
+static unsigned int fdcache_hits;
+static unsigned int fdcache_misses;
+
+
+/**
+ *
+ */
+void
+stash_file_release(stash_file_t *sf)
+{
+  if(__sync_sub_and_fetch(&sf->refcount, 1))
+    return;
+  for(int i = 0; i < sf->num_fds; i++)
+    close(sf->fds[i]);
+  free(sf);
+}
+
+
+/**
+ * Get an fd for exclusive use by the caller, opening 'path' if all
+ * cached ones are busy. Returns -1 on failure
+ */
+int
+stash_file_checkout(stash_file_t *sf, const char *path)
+{
+  int fd = -1;
+
+  pthread_mutex_lock(&fdcache_mutex);
+  if(sf->num_fds > 0)
+    fd = sf->fds[--sf->num_fds];
+  pthread_mutex_unlock(&fdcache_mutex);
+
+  if(fd == -1) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+      trace(LOG_INFO, "Unable to open '%s' -- %s", path, strerror(errno));
+  }
+  return fd;
+}
+
+
+/**
+ * Give back an fd from stash_file_checkout()
+ */
+void
+stash_file_checkin(stash_file_t *sf, int fd)
+{
+  pthread_mutex_lock(&fdcache_mutex);
+  if(sf->num_fds < STASH_FILE_MAXFDS) {
+    sf->fds[sf->num_fds++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&fdcache_mutex);
+
+  if(fd != -1)
+    close(fd);
+}
+
+
+/**
+ *
+ */
+static cached_file_t *
+fdcache_find(const char *digest, uint32_t hash)
+{
+  cached_file_t *cf;
+  LIST_FOREACH(cf, &fdcache_hash[hash % FDCACHE_HASH_SIZE], hash_link)
+    if(cf->hash == hash && !strcmp(cf->digest, digest))
+      return cf;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+fdcache_unlink(cached_file_t *cf)
+{
+  LIST_REMOVE(cf, hash_link);
+  TAILQ_REMOVE(&fdcache_lru, cf, lru_link);
+  fdcache_entries--;
+  stash_file_release(&cf->sf);
+}
+
+
+/**
+ * Return a reference to an already open object or NULL
+ */
+stash_file_t *
+fdcache_get(const char *digest)
+{
+  const uint32_t hash = strhash(digest);
+  cached_file_t *cf;
+
+  pthread_mutex_lock(&fdcache_mutex);
+  cf = fdcache_find(digest, hash);
+  if(cf != NULL) {
+    TAILQ_REMOVE(&fdcache_lru, cf, lru_link);
+    TAILQ_INSERT_HEAD(&fdcache_lru, cf, lru_link);
+    __sync_add_and_fetch(&cf->sf.refcount, 1);
+    fdcache_hits++;
+  } else {
+    fdcache_misses++;
+  }
+  pthread_mutex_unlock(&fdcache_mutex);
+  return cf != NULL ? &cf->sf : NULL;
+}
+
+
+/**
+ * Hand over an open fd to the cache and return a reference to it. If
+ * another thread got there first 'fd' is closed and theirs is returned
+ */
+stash_file_t *
+fdcache_insert(const char *digest, int fd, int64_t size)
+{
+  cfg_root(root);
+  const int maxentries = cfg_get_int(root, CFG("stash", "fdcachesize"), 256);
+
+  cached_file_t *cf = malloc(sizeof(cached_file_t));
+  cf->sf.refcount = 1;
+  cf->sf.num_fds = 1;
+  cf->sf.fds[0] = fd;
+  cf->sf.size = size;
+  snprintf(cf->digest, sizeof(cf->digest), "%s", digest);
+  cf->hash = strhash(cf->digest);
+
+  if(maxentries <= 0)
+    return &cf->sf;
+
+  pthread_mutex_lock(&fdcache_mutex);
+
+  cached_file_t *old = fdcache_find(cf->digest, cf->hash);
+  if(old != NULL) {
+    __sync_add_and_fetch(&old->sf.refcount, 1);
+    pthread_mutex_unlock(&fdcache_mutex);
+    stash_file_release(&cf->sf);
+    return &old->sf;
+  }
+
+  cf->sf.refcount++;
+  LIST_INSERT_HEAD(&fdcache_hash[cf->hash % FDCACHE_HASH_SIZE], cf,
+                   hash_link);
+  TAILQ_INSERT_HEAD(&fdcache_lru, cf, lru_link);
+  fdcache_entries++;
+
+  while(fdcache_entries > maxentries &&
+        (old = TAILQ_LAST(&fdcache_lru, cached_file_queue)) != cf)
+    fdcache_unlink(old);
+
+  pthread_mutex_unlock(&fdcache_mutex);
+  return &cf->sf;
+}
+
+
+/**
+ * Forget an object, for when it is deleted or found to be corrupt.
+ * Downloads already in progress keep their reference
+ */
+void
+fdcache_remove(const char *digest)
+{
+  pthread_mutex_lock(&fdcache_mutex);
+  cached_file_t *cf = fdcache_find(digest, strhash(digest));
+  if(cf != NULL)
+    fdcache_unlink(cf);
+  pthread_mutex_unlock(&fdcache_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+show_stash_fds(const char *user,
+               int argc, const char **argv, int *intv,
+               void (*msg)(void *opaque, const char *fmt, ...),
+               void *opaque)
+{
+  pthread_mutex_lock(&fdcache_mutex);
+  msg(opaque, "%d open files, %u hits, %u misses",
+      fdcache_entries, fdcache_hits, fdcache_misses);
+  pthread_mutex_unlock(&fdcache_mutex);
+  return 0;
+}
+
+CMD(show_stash_fds,
+    CMD_LITERAL("show"),
+    CMD_LITERAL("stash"),
+    CMD_LITERAL("fds")
+    );
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#define STASH_FILE_MAXFDS 4
+
+/**
+ * An open, read-only stash object. Each download checks out an fd of
+ * its own so it may use (and move) the file position, as sendfile does
+ */
+typedef struct stash_file {
+  int refcount;
+  int num_fds;
+  int fds[STASH_FILE_MAXFDS];  // Idle fds, protected by the cache mutex
+  int64_t size;
+} stash_file_t;
+
+stash_file_t *fdcache_get(const char *digest);
+
+stash_file_t *fdcache_insert(const char *digest, int fd, int64_t size);
+
+int stash_file_checkout(stash_file_t *sf, const char *path);
+
+void stash_file_checkin(stash_file_t *sf, int fd);
+
+void stash_file_release(stash_file_t *sf);
+
+void fdcache_remove(const char *digest);
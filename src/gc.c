@@ -0,0 +1,341 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/db.h"
+#include "libsvc/cmd.h"
+
+#include "gc.h"
+#include "stash.h"
+#include "spmc.h"
+
+/**
+ * Mark and sweep of stash objects no longer referenced by any version.
+ * Objects younger than the grace period are always kept so blobs
+ * written by an ingest that has not committed yet are safe
+ */
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open addressed set of raw digests
+ */
+typedef struct digest_set {
+  uint8_t (*slots)[20];
+  uint8_t *used;
+  size_t size;   // Power of two
+  size_t count;
+} digest_set_t;
+
+
+/**
+ *
+ */
+static void
+digest_set_init(digest_set_t *ds)
+{
+  ds->size = 1024;
+  ds->count = 0;
+  ds->slots = malloc(ds->size * 20);
+  ds->used = calloc(ds->size, 1);
+}
+
+
+/**
+ *
+ */
+static size_t
+digest_set_slot(const digest_set_t *ds, const uint8_t digest[20])
+{
+  uint32_t h;
+  memcpy(&h, digest, 4);
+  size_t i = h & (ds->size - 1);
+  while(ds->used[i] && memcmp(ds->slots[i], digest, 20))
+    i = (i + 1) & (ds->size - 1);
+  return i;
+}
+
+
+/**
+ *
+ */
+static void
+digest_set_add(digest_set_t *ds, const uint8_t digest[20])
+{
+  if(ds->count * 2 >= ds->size) {
+    digest_set_t n = {
+      .size = ds->size * 2,
+      .slots = malloc(ds->size * 2 * 20),
+      .used = calloc(ds->size * 2, 1),
+    };
+    for(size_t i = 0; i < ds->size; i++)
+      if(ds->used[i])
+        digest_set_add(&n, ds->slots[i]);
+    free(ds->slots);
+    free(ds->used);
+    *ds = n;
+  }
+
+  const size_t i = digest_set_slot(ds, digest);
+  if(!ds->used[i]) {
+    memcpy(ds->slots[i], digest, 20);
+    ds->used[i] = 1;
+    ds->count++;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+digest_set_contains(const digest_set_t *ds, const uint8_t digest[20])
+{
+  return ds->used[digest_set_slot(ds, digest)];
+}
+
+
+/**
+ *
+ */
+static void
+digest_set_destroy(digest_set_t *ds)
+{
+  free(ds->slots);
+  free(ds->used);
+}
+
+
+/**
+ * Collect every digest referenced from the version table
+ */
+static int
+gc_mark(digest_set_t *ds)
+{
+  uint8_t d[20];
+
+  db_conn_t *c = db_get_conn();
+  if(c == NULL)
+    return -1;
+
+  db_stmt_t *s = db_stmt_get(c, "SELECT pkg_digest, IFNULL(icon_digest,'') "
+                             "FROM version");
+  if(db_stmt_exec(s, ""))
+    return -1;
+
+  while(1) {
+    char pkg_digest[64];
+    char icon_digest[64];
+
+    int r = db_stream_row(0, s,
+                          DB_RESULT_STRING(pkg_digest),
+                          DB_RESULT_STRING(icon_digest));
+    if(r < 0)
+      return -1;
+    if(r)
+      return 0;
+
+    if(!digest_parse(d, pkg_digest))
+      digest_set_add(ds, d);
+    if(!digest_parse(d, icon_digest))
+      digest_set_add(ds, d);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+gc_run(int dryrun, void (*msg)(void *opaque, const char *fmt, ...),
+       void *opaque)
+{
+  cfg_root(root);
+  const char *stashdir = cfg_get_str(root, CFG("stashdir"), NULL);
+  const int grace = cfg_get_int(root, CFG("stash", "gc", "grace"), 86400);
+  char path[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  uint8_t d[20];
+  digest_set_t ds;
+  unsigned int kept = 0, removed = 0, young = 0;
+  int64_t removed_bytes = 0;
+
+  if(stashdir == NULL) {
+    msg(opaque, "No stashdir configured");
+    return;
+  }
+
+  if(pthread_mutex_trylock(&gc_mutex)) {
+    msg(opaque, "GC already in progress");
+    return;
+  }
+
+  digest_set_init(&ds);
+
+  if(gc_mark(&ds)) {
+    msg(opaque, "Unable to load referenced digests from database");
+    goto out;
+  }
+
+  if(ds.count == 0) {
+    // Far more likely to be a broken database than an empty one
+    msg(opaque, "No referenced objects at all, refusing to sweep");
+    goto out;
+  }
+
+  const time_t cutoff = time(NULL) - grace;
+
+  for(int shard = 0; shard < 256; shard++) {
+    snprintf(path, sizeof(path), "%s/%02x", stashdir, shard);
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+      continue;
+
+    while((de = readdir(dir)) != NULL) {
+      if(digest_parse(d, de->d_name))
+        continue;
+
+      if(digest_set_contains(&ds, d)) {
+        kept++;
+        continue;
+      }
+
+      if(fstatat(dirfd(dir), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+        continue;
+
+      if(st.st_mtime > cutoff) {
+        young++;
+        continue;
+      }
+
+      if(dryrun) {
+        msg(opaque, "Would remove %s (%"PRId64" bytes)",
+            de->d_name, (int64_t)st.st_size);
+      } else {
+        if(unlinkat(dirfd(dir), de->d_name, 0)) {
+          msg(opaque, "Unable to remove %s -- %s",
+              de->d_name, strerror(errno));
+          continue;
+        }
+        stash_forget(de->d_name);
+      }
+      removed++;
+      removed_bytes += st.st_size;
+    }
+    closedir(dir);
+  }
+
+  msg(opaque, "%s %u unreferenced objects (%"PRId64" bytes), "
+      "kept %u referenced and %u within grace period",
+      dryrun ? "Would remove" : "Removed", removed, removed_bytes,
+      kept, young);
+
+ out:
+  digest_set_destroy(&ds);
+  pthread_mutex_unlock(&gc_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+gc_trace(void *opaque, const char *fmt, ...)
+{
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  trace(LOG_INFO, "Stash GC: %s", buf);
+}
+
+
+/**
+ * Scheduled GC, only runs if stash.gc.interval is set
+ */
+static void *
+gc_thread(void *aux)
+{
+  while(1) {
+    cfg_root(root);
+    const int interval = cfg_get_int(root, CFG("stash", "gc", "interval"), 0);
+    const int dryrun = cfg_get_int(root, CFG("stash", "gc", "dryrun"), 0);
+
+    if(interval <= 0) {
+      sleep(3600);
+      continue;
+    }
+    sleep(interval);
+    gc_run(dryrun, gc_trace, NULL);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+gc_init(void)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, gc_thread, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+/**
+ *
+ */
+static int
+gc_cmd(const char *user,
+       int argc, const char **argv, int *intv,
+       void (*msg)(void *opaque, const char *fmt, ...),
+       void *opaque)
+{
+  gc_run(0, msg, opaque);
+  return 0;
+}
+
+CMD(gc_cmd,
+    CMD_LITERAL("gc"),
+    CMD_LITERAL("run")
+    );
+
+
+/**
+ *
+ */
+static int
+gc_dryrun_cmd(const char *user,
+              int argc, const char **argv, int *intv,
+              void (*msg)(void *opaque, const char *fmt, ...),
+              void *opaque)
+{
+  gc_run(1, msg, opaque);
+  return 0;
+}
+
+CMD(gc_dryrun_cmd,
+    CMD_LITERAL("gc"),
+    CMD_LITERAL("dryrun")
+    );
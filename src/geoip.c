@@ -0,0 +1,310 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/cmd.h"
+
+#include "geoip.h"
+
+/**
+ * On-disk database, all integers in network byte order:
+ *
+ *   "SPMG" <u32 version> <u32 count> count * geoip_range_t
+ *
+ * Ranges are sorted on 'first' and do not overlap. Build one from a
+ * "first,last,cc" CSV (db-ip / ip2location lite style) with the
+ * 'geoip build' command.
+ */
+#define GEOIP_MAGIC   "SPMG"
+#define GEOIP_VERSION 1
+
+typedef struct geoip_range {
+  uint32_t first;
+  uint32_t last;
+  char cc[2];
+  char pad[2];
+} geoip_range_t;
+
+typedef struct geoip_db {
+  const geoip_range_t *ranges;
+  uint32_t count;
+} geoip_db_t;
+
+// Published once, never unmapped, so readers don't need any locking
+static geoip_db_t *geoip_db;
+
+
+/**
+ *
+ */
+static geoip_db_t *
+geoip_open(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1) {
+    trace(LOG_ERR, "GeoIP: Unable to open %s -- %s", path, strerror(errno));
+    return NULL;
+  }
+
+  if(fstat(fd, &st) || st.st_size < 12) {
+    trace(LOG_ERR, "GeoIP: %s is not a valid database", path);
+    close(fd);
+    return NULL;
+  }
+
+  const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) {
+    trace(LOG_ERR, "GeoIP: Unable to mmap %s -- %s", path, strerror(errno));
+    return NULL;
+  }
+
+  uint32_t version, count;
+  memcpy(&version, base + 4, 4);
+  memcpy(&count,   base + 8, 4);
+  version = ntohl(version);
+  count   = ntohl(count);
+
+  if(memcmp(base, GEOIP_MAGIC, 4) || version != GEOIP_VERSION ||
+     (st.st_size - 12) / sizeof(geoip_range_t) < count) {
+    trace(LOG_ERR, "GeoIP: %s is not a valid database", path);
+    munmap((void *)base, st.st_size);
+    return NULL;
+  }
+
+  const geoip_range_t *ranges = (const geoip_range_t *)(base + 12);
+  for(uint32_t i = 1; i < count; i++) {
+    if(ntohl(ranges[i].first) <= ntohl(ranges[i - 1].last)) {
+      trace(LOG_ERR, "GeoIP: %s is not sorted", path);
+      munmap((void *)base, st.st_size);
+      return NULL;
+    }
+  }
+
+  geoip_db_t *db = malloc(sizeof(geoip_db_t));
+  db->ranges = ranges;
+  db->count = count;
+  trace(LOG_INFO, "GeoIP: Loaded %u ranges from %s", count, path);
+  return db;
+}
+
+
+/**
+ *
+ */
+void
+geoip_init(void)
+{
+  cfg_root(root);
+  const char *path = cfg_get_str(root, CFG("geoip", "database"), NULL);
+  if(path == NULL)
+    return;
+
+  geoip_db_t *db = geoip_open(path);
+  if(db != NULL)
+    __atomic_store_n(&geoip_db, db, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Map an IPv4 peer to an upper case ISO 3166 country code.
+ * Returns 0 if found
+ */
+int
+geoip_lookup(const struct sockaddr_in *sin, char cc[3])
+{
+  const geoip_db_t *db = __atomic_load_n(&geoip_db, __ATOMIC_ACQUIRE);
+
+  if(db == NULL || sin == NULL || sin->sin_family != AF_INET)
+    return -1;
+
+  const uint32_t addr = ntohl(sin->sin_addr.s_addr);
+  uint32_t lo = 0, hi = db->count;
+
+  while(lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    const geoip_range_t *r = &db->ranges[mid];
+    if(addr < ntohl(r->first)) {
+      hi = mid;
+    } else if(addr > ntohl(r->last)) {
+      lo = mid + 1;
+    } else {
+      if(r->cc[0] == 0)
+        return -1;
+      cc[0] = r->cc[0];
+      cc[1] = r->cc[1];
+      cc[2] = 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static int
+geoip_range_cmp(const void *A, const void *B)
+{
+  const geoip_range_t *a = A, *b = B;
+  return a->first < b->first ? -1 : a->first > b->first;
+}
+
+
+/**
+ *
+ */
+static int
+geoip_parse_ip(const char *str, uint32_t *ip)
+{
+  struct in_addr ia;
+  if(inet_pton(AF_INET, str, &ia) != 1)
+    return -1;
+  *ip = ntohl(ia.s_addr);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+geoip_build(const char *user,
+            int argc, const char **argv, int *intv,
+            void (*msg)(void *opaque, const char *fmt, ...),
+            void *opaque)
+{
+  char line[512];
+  geoip_range_t *ranges = NULL;
+  int count = 0, capacity = 0, skipped = 0;
+
+  FILE *fp = fopen(argv[0], "r");
+  if(fp == NULL) {
+    msg(opaque, "Unable to open %s -- %s", argv[0], strerror(errno));
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    char *fields[3];
+    char *s = line;
+    int n;
+
+    for(n = 0; n < 3; n++) {
+      char *f = strsep(&s, ",");
+      if(f == NULL)
+        break;
+      f += strspn(f, " \t\"");
+      f[strcspn(f, " \t\"\r\n")] = 0;
+      fields[n] = f;
+    }
+
+    geoip_range_t r = {};
+    if(n != 3 || strlen(fields[2]) != 2 ||
+       geoip_parse_ip(fields[0], &r.first) ||
+       geoip_parse_ip(fields[1], &r.last) || r.first > r.last) {
+      skipped++; // Headers, IPv6 and garbage
+      continue;
+    }
+    r.cc[0] = toupper((unsigned char)fields[2][0]);
+    r.cc[1] = toupper((unsigned char)fields[2][1]);
+
+    if(count == capacity) {
+      capacity = capacity * 2 + 1024;
+      ranges = realloc(ranges, capacity * sizeof(geoip_range_t));
+    }
+    ranges[count++] = r;
+  }
+  fclose(fp);
+
+  qsort(ranges, count, sizeof(geoip_range_t), geoip_range_cmp);
+
+  // Drop overlapping ranges, first one wins
+  int j = 0;
+  for(int i = 0; i < count; i++) {
+    if(j > 0 && ranges[i].first <= ranges[j - 1].last) {
+      skipped++;
+      continue;
+    }
+    ranges[j++] = ranges[i];
+  }
+  count = j;
+
+  const size_t size = 12 + count * sizeof(geoip_range_t);
+  uint8_t *out = malloc(size);
+  uint32_t u32;
+
+  memcpy(out, GEOIP_MAGIC, 4);
+  u32 = htonl(GEOIP_VERSION);
+  memcpy(out + 4, &u32, 4);
+  u32 = htonl(count);
+  memcpy(out + 8, &u32, 4);
+
+  geoip_range_t *dst = (geoip_range_t *)(out + 12);
+  for(int i = 0; i < count; i++) {
+    dst[i] = ranges[i];
+    dst[i].first = htonl(ranges[i].first);
+    dst[i].last  = htonl(ranges[i].last);
+  }
+  free(ranges);
+
+  int r = writefile(argv[1], out, size);
+  free(out);
+
+  if(r && r != WRITEFILE_NO_CHANGE)
+    msg(opaque, "Unable to write %s -- %s", argv[1], strerror(r));
+  else
+    msg(opaque, "OK, %d ranges written, %d lines skipped. "
+        "Restart to load it", count, skipped);
+  return 0;
+}
+
+CMD(geoip_build,
+    CMD_LITERAL("geoip"),
+    CMD_LITERAL("build"),
+    CMD_VARSTR("csvfile"),
+    CMD_VARSTR("output")
+    );
+
+
+/**
+ *
+ */
+static int
+geoip_lookup_cmd(const char *user,
+                 int argc, const char **argv, int *intv,
+                 void (*msg)(void *opaque, const char *fmt, ...),
+                 void *opaque)
+{
+  struct sockaddr_in sin = {.sin_family = AF_INET};
+  char cc[3];
+
+  if(inet_pton(AF_INET, argv[0], &sin.sin_addr) != 1) {
+    msg(opaque, "Invalid IPv4 address");
+    return 0;
+  }
+
+  if(geoip_lookup(&sin, cc))
+    msg(opaque, "%s: Unknown", argv[0]);
+  else
+    msg(opaque, "%s: %s", argv[0], cc);
+  return 0;
+}
+
+CMD(geoip_lookup_cmd,
+    CMD_LITERAL("geoip"),
+    CMD_LITERAL("lookup"),
+    CMD_VARSTR("address")
+    );
@@ -0,0 +1,7 @@
+#pragma once
+
+struct sockaddr_in;
+
+void geoip_init(void);
+
+int geoip_lookup(const struct sockaddr_in *sin, char cc[3]);
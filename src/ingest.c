@@ -1,10 +1,18 @@
+#include <sys/param.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "libsvc/http.h"
@@ -20,15 +28,20 @@
 #include "ingest.h"
 #include "stash.h"
 #include "events.h"
+#include "catalog.h"
+#include "arena.h"
 
 TAILQ_HEAD(file_queue, file);
+LIST_HEAD(file_list, file);
 
+#define FILE_HASH_SIZE 256
 
 /**
  *
  */
 typedef struct file {
   TAILQ_ENTRY(file) link;
+  LIST_ENTRY(file) hash_link;
   char *path;
   char *data;
   size_t size;
@@ -37,19 +50,60 @@ typedef struct file {
 } file_t;
 
 
+/**
+ * All entries of an archive being ingested. Entries and their data are
+ * carved from a single arena, the name index is built once the path
+ * prefix to strip is known
+ */
+typedef struct file_set {
+  arena_t arena;
+  struct file_queue files;
+  struct file_list hash[FILE_HASH_SIZE];
+} file_set_t;
+
+
+// Arena space needed for an entry besides its data and path: the
+// file_t itself and alignment padding of the three allocations
+#define FILE_ENTRY_OVERHEAD (sizeof(file_t) + 3 * 16)
+
+/**
+ * size_hint is the space all entries need, summed from archive metadata.
+ * It normally fits everything in a single chunk. Without a hint, start
+ * at 1 MB and double for each new chunk so no more than about half of
+ * the reserved memory goes unused
+ */
+static void
+file_set_init(file_set_t *fs, size_t size_hint)
+{
+  arena_init(&fs->arena, size_hint ?: 1024 * 1024);
+  arena_set_max_chunksize(&fs->arena, 64 * 1024 * 1024);
+  TAILQ_INIT(&fs->files);
+  for(int i = 0; i < FILE_HASH_SIZE; i++)
+    LIST_INIT(&fs->hash[i]);
+}
+
+
 /**
  *
  */
 static void
-release_fq(struct file_queue *fq)
+release_fq(file_set_t *fs)
 {
-  file_t *f, *next;
+  arena_destroy(&fs->arena);
+}
 
-  for(f = TAILQ_FIRST(fq); f != NULL; f = next) {
-    next = TAILQ_NEXT(f, link);
-    free(f->path);
-    free(f->data);
-    free(f);
+
+/**
+ *
+ */
+static void
+file_set_index(file_set_t *fs, int strip_path_prefix)
+{
+  file_t *f;
+  TAILQ_FOREACH(f, &fs->files, link) {
+    f->name = f->path + strip_path_prefix;
+    LIST_INSERT_HEAD(&fs->hash[strhash(f->name) % FILE_HASH_SIZE], f,
+                     hash_link);
   }
 }
 
@@ -58,15 +112,64 @@ release_fq(struct file_queue *fq)
  *
  */
 static file_t *
-find_name(struct file_queue *fq, const char *name)
+find_name(file_set_t *fs, const char *name)
 {
   file_t *f;
-  TAILQ_FOREACH(f, fq, link)
+  LIST_FOREACH(f, &fs->hash[strhash(name) % FILE_HASH_SIZE], hash_link)
     if(!strcmp(f->name, name))
       return f;
   return NULL;
 }
 
+/**
+ * Flatten a manifest field that may be either a single string or a list
+ * of strings into a comma separated list. Only [A-Za-z0-9_-] tokens are
+ * accepted so the result can be matched with csv_contains()
+ */
+static int
+manifest_csv(htsmsg_t *manifest, const char *key, char *buf, size_t size)
+{
+  htsmsg_t *list;
+  htsmsg_field_t *f;
+  const char *str;
+  size_t len = 0;
+
+  buf[0] = 0;
+
+  if((list = htsmsg_get_list(manifest, key)) != NULL) {
+    HTSMSG_FOREACH(f, list) {
+      if(f->hmf_type != HMF_STR)
+        return -1;
+      str = f->hmf_str;
+      if(!*str || strspn(str, "abcdefghijklmnopqrstuvwxyz"
+                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                         "0123456789_-") != strlen(str))
+        return -1;
+      int r = snprintf(buf + len, size - len, "%s%s", len ? "," : "", str);
+      if(r < 0 || r >= size - len)
+        return -1;
+      len += r;
+    }
+    return 0;
+  }
+
+  if((str = htsmsg_get_str(manifest, key)) == NULL)
+    return 0;
+
+  // A single string may already be comma separated
+  if(strspn(str, "abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "0123456789_-,") != strlen(str) ||
+     strstr(str, ",,") != NULL || *str == ',' ||
+     (*str && str[strlen(str) - 1] == ','))
+    return -1;
+
+  if(snprintf(buf, size, "%s", str) >= size)
+    return -1;
+  return 0;
+}
+
+
 /**
  *
  */
@@ -76,7 +179,22 @@ ensure_plugin(db_conn_t *c, const char *id, int userid, const char *origin)
   int current_user_id;
   db_stmt_t *s;
 
-  s = db_stmt_get(c, "SELECT userid FROM plugin WHERE id=?");
+  // Bulk ingest may create the same plugin from several threads at
+  // once. The loser blocks on the winner's row and then ignores it
+  s = db_stmt_get(c, "INSERT IGNORE INTO plugin (id, userid,downloadurl) VALUES (?,?,?)");
+  if(db_stmt_exec(s, "sis", id, userid, origin))
+    return -1;
+  int created = db_stmt_affected_rows(s);
+  db_stmt_reset(s);
+
+  if(created) {
+    event_add(c, id, userid, "Plugin created");
+    return 0;
+  }
+
+  // Locking read, a plain one would not see a row committed after our
+  // transaction took its snapshot
+  s = db_stmt_get(c, "SELECT userid FROM plugin WHERE id=? LOCK IN SHARE MODE");
   if(db_stmt_exec(s, "s", id))
     return -1;
 
@@ -86,18 +204,145 @@ ensure_plugin(db_conn_t *c, const char *id, int userid, const char *origin)
 
   db_stmt_reset(s);
 
-  if(r < 0)
+  if(r)
     return -1;
 
-  if(r) {
-    s = db_stmt_get(c, "INSERT INTO plugin (id, userid,downloadurl) VALUES (?,?,?)");
-    if(db_stmt_exec(s, "sis", id, userid, origin))
-      return -1;
+  return userid != current_user_id;
+}
+
+
+/**
+ * plugin.json is accepted in the root or in a single sub-directory
+ */
+static int
+is_manifest_path(const char *path)
+{
+  const char *x = strchr(path, '/');
+  if(x == NULL)
+    return !strcmp(path, "plugin.json");
+  return !strcmp(x + 1, "plugin.json");
+}
+
+
+/**
+ * Cheap read-only checks that can reject an ingest as soon as the
+ * manifest is known, before the rest of the archive is extracted.
+ * The authoritative checks are repeated inside the transaction
+ */
+static int
+ingest_precheck(db_conn_t *c, const char *json, int userid, int flags,
+                void (*msg)(void *opaque, const char *fmt, ...),
+                void *opaque)
+{
+  char errbuf[512];
+  int owner;
+  time_t created;
+  int r = -1;
+
+  htsmsg_t *manifest = htsmsg_json_deserialize(json, errbuf, sizeof(errbuf));
+  if(manifest == NULL) {
+    msg(opaque, "Unable to decode plugin.json -- %s", errbuf);
+    return -1;
+  }
+
+  const char *id      = htsmsg_get_str(manifest, "id");
+  const char *version = htsmsg_get_str(manifest, "version");
+
+  if(htsmsg_get_str(manifest, "type") == NULL) {
+    msg(opaque, "'type' missing from plugin.json");
+    goto out;
+  }
+  if(id == NULL) {
+    msg(opaque, "'id' missing from plugin.json");
+    goto out;
+  }
+  if(version == NULL) {
+    msg(opaque, "'version' missing from plugin.json");
+    goto out;
+  }
+
+  db_stmt_t *s = db_stmt_get(c, SQL_CHECK_VERSION);
+  if(db_stmt_exec(s, "ss", id, version)) {
+    msg(opaque, "Database query problems");
+    goto out;
+  }
+  int q = db_stream_row(0, s, DB_RESULT_TIME(created), NULL);
+  db_stmt_reset(s);
+  if(q < 0) {
+    msg(opaque, "Database query problems");
+    goto out;
+  }
+  if(q == 0) {
+    msg(opaque, "%s %s already ingested", id, version);
+    goto out;
+  }
+
+  if(!(flags & SPMC_USER_ADMIN)) {
+    s = db_stmt_get(c, "SELECT userid FROM plugin WHERE id=?");
+    if(db_stmt_exec(s, "s", id)) {
+      msg(opaque, "Database query problems");
+      goto out;
+    }
+    q = db_stream_row(0, s, DB_RESULT_INT(owner), NULL);
     db_stmt_reset(s);
-    event_add(c, id, userid, "Plugin created");
-    return 0;
+    if(q < 0) {
+      msg(opaque, "Database query problems");
+      goto out;
+    }
+    if(q == 0 && owner != userid) {
+      msg(opaque, "Not owner of plugin, ingest denied");
+      goto out;
+    }
   }
-  return userid != current_user_id;
+  r = 0;
+ out:
+  htsmsg_destroy(manifest);
+  return r;
+}
+
+
+/**
+ * libarchive write callback streaming the repacked zip into the stash
+ */
+static ssize_t
+stash_archive_write(struct archive *a, void *opaque,
+                    const void *data, size_t size)
+{
+  if(stash_writer_append(opaque, data, size)) {
+    archive_set_error(a, EIO, "Unable to write to stash");
+    return -1;
+  }
+  return size;
+}
+
+
+/**
+ * Zip entries written with a data descriptor (general purpose bit 3) have
+ * no sizes in the local header. When the archive is streamed libarchive
+ * can't look them up in the central directory so read until it says stop
+ */
+static int
+read_unsized_entry(struct archive *a, arena_t *arena, file_t *f)
+{
+  size_t capacity = 65536;
+  char *buf = malloc(capacity);
+  ssize_t r;
+
+  f->size = 0;
+  while((r = archive_read_data(a, buf + f->size, capacity - f->size)) > 0) {
+    f->size += r;
+    if(f->size == capacity) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+    }
+  }
+
+  if(r == 0) {
+    f->data = arena_alloc(arena, f->size + 1);
+    memcpy(f->data, buf, f->size);
+  }
+  free(buf);
+  return r ? -1 : 0;
 }
 
 
@@ -108,17 +353,19 @@ static int
 ingest_zip(struct archive *a,
            void (*msg)(void *opaque, const char *fmt, ...),
            void *opaque, int userid, int flags,
-           ingest_result_t *result, const char *origin)
+           ingest_result_t *result, const char *origin, size_t size_hint)
 {
   htsmsg_t *manifest = NULL;
   char errbuf[512];
   struct archive_entry *entry;
-  struct file_queue fq;
+  file_set_t fq;
   int in_transaction = 0;
   char tstr[64];
   struct tm tm;
+  file_t *root_json = NULL;
+  file_t *sub_json = NULL;
 
-  TAILQ_INIT(&fq);
+  file_set_init(&fq, size_hint);
 
   db_conn_t *c = db_get_conn();
   if(c == NULL) {
@@ -127,50 +374,68 @@ ingest_zip(struct archive *a,
   }
 
   msg(opaque, "---- Archive contents ---------------");
-  while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+  int ar;
+  while((ar = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
 
-    file_t *f = calloc(1, sizeof(file_t));
-    f->size = archive_entry_size(entry);
-    f->data = malloc(f->size + 1);
-    f->data[f->size] = 0; // Null terminate all content internally
+    file_t *f = arena_alloc(&fq.arena, sizeof(file_t));
     f->type = archive_entry_filetype(entry);
 
-    int64_t r = archive_read_data(a, f->data, f->size);
+    int r;
+    if(archive_entry_size_is_set(entry)) {
+      f->size = archive_entry_size(entry);
+      f->data = arena_alloc(&fq.arena, f->size + 1);
+      r = archive_read_data(a, f->data, f->size) == f->size ? 0 : -1;
+    } else {
+      r = read_unsized_entry(a, &fq.arena, f);
+    }
 
-    if(r != f->size) {
+    if(r) {
       msg(opaque, "%-50s %6d bytes *** FAILED TO EXTRACT FILE ***",
           archive_entry_pathname(entry), (int)f->size);
-      free(f->data);
-      free(f);
       goto fail;
     } else {
+      f->data[f->size] = 0; // Null terminate all content internally
       msg(opaque, "%-50s %6d bytes",
           archive_entry_pathname(entry), (int)f->size);
 
-      f->path = strdup(archive_entry_pathname(entry));
+      f->path = arena_strdup(&fq.arena, archive_entry_pathname(entry));
       f->name = f->path;
-      TAILQ_INSERT_TAIL(&fq, f, link);
+      TAILQ_INSERT_TAIL(&fq.files, f, link);
+    }
+
+    if(is_manifest_path(f->path)) {
+      if(!strcmp(f->path, "plugin.json")) {
+        root_json = f;
+
+        // Fail fast if the manifest tells us this ingest is pointless.
+        // One in a sub-directory is only used if there is no root
+        // plugin.json, which isn't known until everything is extracted
+        if(ingest_precheck(c, f->data, userid, flags, msg, opaque))
+          goto fail;
+      } else if(sub_json == NULL) {
+        sub_json = f;
+      }
     }
   }
 
   msg(opaque, "-----------------------------------");
 
+  // A truncated download must not be ingested as a smaller package
+  if(ar != ARCHIVE_EOF) {
+    msg(opaque, "Unable to read archive -- %s", archive_error_string(a));
+    goto fail;
+  }
+
   // --- Try to find the manifest file (plugin.json)
 
   int strip_path_prefix = 0;
-  file_t *json = find_name(&fq, "plugin.json");
+  file_t *json = root_json;
 
   if(json == NULL) {
-    file_t *f;
+    file_t *f = sub_json;
 
     // plugin.json not found, check if it's in a subdir
 
-    TAILQ_FOREACH(f, &fq, link) {
-      const char *x = strchr(f->path, '/');
-      if(x != NULL && !strcmp(x + 1, "plugin.json"))
-        break;
-    }
-
     if(f == NULL) {
       msg(opaque, "plugin.json was not found in root or in a sub-directory");
       goto fail;
@@ -185,7 +450,7 @@ ingest_zip(struct archive *a,
     strip_path_prefix = x - f->path + 1;
     const char *y = f->path;
 
-    TAILQ_FOREACH(f, &fq, link) {
+    TAILQ_FOREACH(f, &fq.files, link) {
       if(strncmp(f->path, y, strip_path_prefix)) {
         msg(opaque, "%s is not in same sub-directory as %s", f->path, y);
         goto fail;
@@ -195,9 +460,7 @@ ingest_zip(struct archive *a,
         strip_path_prefix);
   }
 
-  file_t *f;
-  TAILQ_FOREACH(f, &fq, link)
-    f->name = f->path + strip_path_prefix;
+  file_set_index(&fq, strip_path_prefix);
 
   manifest = htsmsg_json_deserialize(json->data, errbuf, sizeof(errbuf));
   if(manifest == NULL) {
@@ -300,10 +563,11 @@ ingest_zip(struct archive *a,
   // Write out package
   //
 
-  char *out = NULL;
-  size_t outlen = 0;
-
-  FILE *memfile = open_memstream(&out, &outlen);
+  stash_writer_t *sw = stash_writer_open();
+  if(sw == NULL) {
+    msg(opaque, "ERROR: Unable to write pkt to disk");
+    goto fail;
+  }
 
   struct archive *aw = archive_write_new();
   archive_write_set_bytes_per_block(aw, 0);
@@ -313,9 +577,10 @@ ingest_zip(struct archive *a,
   // used for sending upgrades
   archive_write_set_format_option(aw, "zip", "compression", "store");
 
-  archive_write_open_FILE(aw, memfile);
+  archive_write_open(aw, sw, NULL, stash_archive_write, NULL);
 
-  TAILQ_FOREACH(f, &fq, link) {
+  file_t *f;
+  TAILQ_FOREACH(f, &fq.files, link) {
     if(f->name[0] == 0 || f->name[0] == '.')
       continue;
 
@@ -327,15 +592,19 @@ ingest_zip(struct archive *a,
     archive_write_data(aw, f->data, f->size);
     archive_entry_free(ae);
   }
+  if(archive_write_close(aw) != ARCHIVE_OK) {
+    msg(opaque, "ERROR: Unable to write pkt to disk -- %s",
+        archive_error_string(aw));
+    archive_write_free(aw);
+    stash_writer_abort(sw);
+    goto fail;
+  }
   archive_write_free(aw);
-  fclose(memfile);
 
-  if(stash_write(out, outlen, pkg_digest)) {
+  if(stash_writer_commit(sw, pkg_digest)) {
     msg(opaque, "ERROR: Unable to write pkt to disk");
-    free(out);
     goto fail;
   }
-  free(out);
 
   //
   // Ok, do the actual insert
@@ -350,13 +619,27 @@ ingest_zip(struct archive *a,
   const char *homepage             = htsmsg_get_str(manifest, "homepage") ?: "";
   const char *comment              = htsmsg_get_str(manifest, "comment") ?: "";
 
+  char arch[256];
+  if(manifest_csv(manifest, "arch", arch, sizeof(arch))) {
+    msg(opaque, "Invalid 'arch' in manifest");
+    goto fail;
+  }
+
+  char regions[1024];
+  if(manifest_csv(manifest, "regions", regions, sizeof(regions))) {
+    msg(opaque, "Invalid 'regions' in manifest");
+    goto fail;
+  }
+  for(char *r = regions; *r; r++)
+    *r = toupper((unsigned char)*r);
+
   const char *status = "p";
 
   if(flags & SPMC_USER_AUTOAPPROVE)
     status = "a";
 
   s = db_stmt_get(c, SQL_INSERT_VERSION);
-  if(db_stmt_exec(s, "ssssssssssssss",
+  if(db_stmt_exec(s, "ssssssssssssssiiss",
                   id,
                   version,
                   type,
@@ -370,7 +653,11 @@ ingest_zip(struct archive *a,
                   pkg_digest,
                   icon_digest,
                   comment,
-                  status)) {
+                  status,
+                  parse_version_int(version),
+                  parse_version_int(showtime_min_version),
+                  arch,
+                  regions)) {
     msg(opaque, "Database query problems");
     goto fail;
   }
@@ -388,6 +675,7 @@ ingest_zip(struct archive *a,
   htsmsg_destroy(manifest);
 
   db_commit(c);
+  catalog_invalidate();
 
   release_fq(&fq);
 
@@ -418,6 +706,92 @@ make_archive(void)
 }
 
 
+/**
+ *
+ */
+static char *
+probe_read_manifest(struct archive *a, struct archive_entry *entry)
+{
+  const int64_t size = archive_entry_size(entry);
+  if(!archive_entry_size_is_set(entry) || size < 0 || size > 1024 * 1024)
+    return NULL;
+
+  char *json = malloc(size + 1);
+  if(archive_read_data(a, json, size) != size) {
+    free(json);
+    return NULL;
+  }
+  json[size] = 0;
+  return json;
+}
+
+
+/**
+ * Look for the manifest without extracting anything else. For zip
+ * files opened from memory or disk libarchive reads the central
+ * directory and skipping an entry is just a seek. Other formats would
+ * have to be decompressed in full just for this, so they are not
+ * probed at all and rely on the root plugin.json check ingest_zip()
+ * does as it goes. Like ingest_zip() a root plugin.json wins over one
+ * in a sub-directory, so the latter is only checked once all entries
+ * have been seen. All headers are walked to size the extraction arena
+ * from, returned in 'unpacked' unless some entry size is unknown.
+ * Returns 0 if the ingest may proceed
+ */
+static int
+ingest_probe(struct archive *a,
+             void (*msg)(void *opaque, const char *fmt, ...),
+             void *opaque, int userid, int flags, size_t *unpacked)
+{
+  struct archive_entry *entry;
+  char *json = NULL;
+  int seen_root = 0;
+  int seen_sub = 0;
+  int r = 0;
+  size_t total = 0;
+  int ar;
+
+  db_conn_t *c = db_get_conn();
+  if(c == NULL)
+    return 0; // ingest_zip() will report this
+
+  while((ar = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+    if((archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_ZIP)
+      return 0;
+
+    const char *path = archive_entry_pathname(entry);
+
+    // Sum up what ingest_zip() will allocate for the entries
+    if(!archive_entry_size_is_set(entry) || archive_entry_size(entry) < 0)
+      total = SIZE_MAX;
+    else if(total != SIZE_MAX)
+      total += archive_entry_size(entry) + 1 + strlen(path) + 1 +
+        FILE_ENTRY_OVERHEAD;
+
+    if(seen_root)
+      continue;
+
+    if(!strcmp(path, "plugin.json")) {
+      free(json);
+      json = probe_read_manifest(a, entry);
+      seen_root = 1;
+    } else if(!seen_sub && is_manifest_path(path)) {
+      json = probe_read_manifest(a, entry);
+      seen_sub = 1;
+    }
+  }
+
+  if(ar == ARCHIVE_EOF && total != SIZE_MAX)
+    *unpacked = total;
+
+  if(json != NULL) {
+    r = ingest_precheck(c, json, userid, flags, msg, opaque);
+    free(json);
+  }
+  return r;
+}
+
+
 /**
  *
  */
@@ -427,18 +801,140 @@ ingest_zip_from_memory(const void *data, size_t datalen,
                        void *opaque, int userid, int flags,
                        ingest_result_t *result, const char *origin)
 {
+  size_t unpacked = 0;
   struct archive *a = make_archive();
   int r = archive_read_open_memory(a, (void *)data, datalen);
+  if(!r && ingest_probe(a, msg, opaque, userid, flags, &unpacked)) {
+    archive_read_free(a);
+    return 1;
+  }
+  archive_read_free(a);
+
+  a = make_archive();
+  r = archive_read_open_memory(a, (void *)data, datalen);
   if(r) {
     msg(opaque, "%s", archive_error_string(a));
   } else {
-    r = ingest_zip(a, msg, opaque, userid, flags, result, origin);
+    r = ingest_zip(a, msg, opaque, userid, flags, result, origin, unpacked);
   }
   archive_read_free(a);
   return r;
 }
 
 
+/**
+ * Streams a download into libarchive. curl writes into a bounded ring
+ * buffer and is paused when it's full. The transfer is driven from the
+ * archive read callback so everything runs on the calling thread.
+ *
+ * Only the download itself is bounded. ingest_zip() still keeps every
+ * extracted entry in memory until the package has been repacked, so
+ * peak memory is roughly the unpacked package size. Uploads are not
+ * streamed at all: the HTTP server hands us the complete body and the
+ * job keeps a copy of it, so they cost the packed plus unpacked size.
+ *
+ * A download that stalls below ingest.lowspeedlimit bytes/s for
+ * ingest.lowspeedtime seconds is aborted instead of tying up a worker.
+ */
+#define URL_STREAM_BUFSIZE (256 * 1024)
+
+typedef struct url_stream {
+  CURLM *multi;
+  CURL *curl;
+  uint8_t *buf;
+  size_t rd;      // Read position in buf
+  size_t used;    // Bytes in buf, starting at rd
+  size_t handed;  // Bytes given to libarchive by the last read
+  int paused;
+  int done;
+  CURLcode result;
+} url_stream_t;
+
+
+/**
+ *
+ */
+static size_t
+url_stream_write(char *ptr, size_t size, size_t nmemb, void *opaque)
+{
+  url_stream_t *us = opaque;
+  const size_t len = size * nmemb;
+
+  // curl wants all or nothing, it will deliver this again once resumed
+  if(len > URL_STREAM_BUFSIZE - us->used) {
+    us->paused = 1;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  const size_t wr = (us->rd + us->used) % URL_STREAM_BUFSIZE;
+  const size_t first = MIN(len, URL_STREAM_BUFSIZE - wr);
+  memcpy(us->buf + wr, ptr, first);
+  memcpy(us->buf, ptr + first, len - first);
+  us->used += len;
+  return len;
+}
+
+
+/**
+ *
+ */
+static void
+url_stream_pump(url_stream_t *us)
+{
+  int running, msgs;
+  CURLMsg *m;
+
+  curl_multi_perform(us->multi, &running);
+
+  while((m = curl_multi_info_read(us->multi, &msgs)) != NULL) {
+    if(m->msg == CURLMSG_DONE) {
+      us->done = 1;
+      us->result = m->data.result;
+    }
+  }
+
+  if(!us->done && us->used == 0)
+    curl_multi_wait(us->multi, NULL, 0, 1000, NULL);
+}
+
+
+/**
+ *
+ */
+static ssize_t
+url_stream_read(struct archive *a, void *opaque, const void **bufp)
+{
+  url_stream_t *us = opaque;
+
+  // libarchive is done with whatever we handed out last time
+  us->rd = (us->rd + us->handed) % URL_STREAM_BUFSIZE;
+  us->used -= us->handed;
+  us->handed = 0;
+
+  while(us->used == 0 && !us->done) {
+    if(us->paused) {
+      us->paused = 0;
+      curl_easy_pause(us->curl, CURLPAUSE_CONT);
+    }
+    url_stream_pump(us);
+  }
+
+  if(us->used == 0) {
+    if(us->result != CURLE_OK) {
+      archive_set_error(a, EIO, "Download failed -- %s",
+                        curl_easy_strerror(us->result));
+      return -1;
+    }
+    return 0;
+  }
+
+  // Only hand out the contiguous part, the rest comes next call
+  us->handed = MIN(us->used, URL_STREAM_BUFSIZE - us->rd);
+  *bufp = us->buf + us->rd;
+  return us->handed;
+}
+
+
 /**
  *
  */
@@ -453,29 +949,40 @@ ingest_zip_from_url(const char *url,
     return 1;
   }
 
-  char *out = NULL;
-  size_t outlen = 0;
-
-  CURL *curl = curl_easy_init();
-
-  FILE *f = open_memstream(&out, &outlen);
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-  CURLcode r = curl_easy_perform(curl);
-  fclose(f);
-  curl_easy_cleanup(curl);
+  url_stream_t us = {};
+  us.buf = malloc(URL_STREAM_BUFSIZE);
+  us.curl = curl_easy_init();
+  us.multi = curl_multi_init();
+
+  curl_easy_setopt(us.curl, CURLOPT_URL, url);
+  curl_easy_setopt(us.curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(us.curl, CURLOPT_WRITEFUNCTION, url_stream_write);
+  curl_easy_setopt(us.curl, CURLOPT_WRITEDATA, &us);
+  curl_easy_setopt(us.curl, CURLOPT_FAILONERROR, 1L);
+
+  cfg_root(root);
+  curl_easy_setopt(us.curl, CURLOPT_LOW_SPEED_LIMIT,
+                   (long)cfg_get_int(root, CFG("ingest", "lowspeedlimit"),
+                                     1024));
+  curl_easy_setopt(us.curl, CURLOPT_LOW_SPEED_TIME,
+                   (long)cfg_get_int(root, CFG("ingest", "lowspeedtime"),
+                                     60));
+  curl_multi_add_handle(us.multi, us.curl);
 
+  struct archive *a = make_archive();
+  int r = archive_read_open(a, &us, NULL, url_stream_read, NULL);
   if(r) {
-    msg(opaque, "Unable to download %s -- %s", url, curl_easy_strerror(r));
-    return 1;
+    msg(opaque, "Unable to download %s -- %s", url, archive_error_string(a));
+  } else {
+    r = ingest_zip(a, msg, opaque, userid, flags, result, url, 0);
   }
+  archive_read_free(a);
 
-  int x = ingest_zip_from_memory(out, outlen, msg, opaque, userid, flags,
-                                 result, url);
-  free(out);
-  return x;
+  curl_multi_remove_handle(us.multi, us.curl);
+  curl_easy_cleanup(us.curl);
+  curl_multi_cleanup(us.multi);
+  free(us.buf);
+  return r;
 }
 
 
@@ -492,13 +999,22 @@ ingest_zip_from_path(const char *path,
   if(!strncmp(path, "http://", 7) || !strncmp(path, "https://", 8))
     return ingest_zip_from_url(path, msg, opaque, userid, flags, result);
 
+  size_t unpacked = 0;
   struct archive *a = make_archive();
   int r = archive_read_open_filename(a, path, 8192);
+  if(!r && ingest_probe(a, msg, opaque, userid, flags, &unpacked)) {
+    archive_read_free(a);
+    return 1;
+  }
+  archive_read_free(a);
+
+  a = make_archive();
+  r = archive_read_open_filename(a, path, 8192);
 
   if(r) {
     msg(opaque, "%s", archive_error_string(a));
   } else {
-    r = ingest_zip(a, msg, opaque, userid, flags, result, NULL);
+    r = ingest_zip(a, msg, opaque, userid, flags, result, NULL, unpacked);
   }
   archive_read_free(a);
   return r;
@@ -524,3 +1040,233 @@ CMD(ingest_file,
     CMD_LITERAL("file"),
     CMD_VARSTR("path")
     );
+
+
+/**
+ * Bulk ingest, archives are spread over a number of threads. Each
+ * thread gets its own database connection since db_get_conn() is
+ * per thread
+ */
+typedef struct bulk_ingest {
+  char **paths;
+  int num_paths;
+  int next;
+
+  pthread_mutex_t mutex;
+  void (*msg)(void *opaque, const char *fmt, ...);
+  void *opaque;
+
+  int ok;
+  int failed;
+  int64_t bytes;
+} bulk_ingest_t;
+
+
+typedef struct bulk_ingest_capture {
+  char last[512];
+} bulk_ingest_capture_t;
+
+
+/**
+ * Per-archive messages are not relayed, just the last one is kept
+ * to explain failures
+ */
+static void
+bulk_ingest_capture(void *opaque, const char *fmt, ...)
+{
+  bulk_ingest_capture_t *bic = opaque;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(bic->last, sizeof(bic->last), fmt, ap);
+  va_end(ap);
+}
+
+
+/**
+ *
+ */
+static void *
+bulk_ingest_thread(void *aux)
+{
+  bulk_ingest_t *bi = aux;
+  bulk_ingest_capture_t bic;
+  ingest_result_t result;
+  struct stat st;
+  int i;
+
+  while((i = __sync_fetch_and_add(&bi->next, 1)) < bi->num_paths) {
+    const char *path = bi->paths[i];
+    const int64_t size = stat(path, &st) ? 0 : st.st_size;
+
+    bic.last[0] = 0;
+    int r = ingest_zip_from_path(path, bulk_ingest_capture, &bic,
+                                 1, SPMC_USER_ADMIN, &result);
+
+    pthread_mutex_lock(&bi->mutex);
+    if(r) {
+      bi->failed++;
+      bi->msg(bi->opaque, "FAILED %s: %s", path, bic.last);
+    } else {
+      bi->ok++;
+      bi->bytes += size;
+      bi->msg(bi->opaque, "OK     %s: %s %s",
+              path, result.pluginid, result.version);
+    }
+    pthread_mutex_unlock(&bi->mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+bulk_ingest_run(char **paths, int num_paths,
+                void (*msg)(void *opaque, const char *fmt, ...),
+                void *opaque)
+{
+  cfg_root(root);
+  int nthreads = cfg_get_int(root, CFG("ingest", "bulkthreads"), 4);
+  bulk_ingest_t bi = {
+    .paths = paths,
+    .num_paths = num_paths,
+    .msg = msg,
+    .opaque = opaque,
+  };
+  struct timespec start, end;
+
+  if(nthreads < 1)
+    nthreads = 1;
+  if(nthreads > num_paths)
+    nthreads = num_paths;
+
+  msg(opaque, "Ingesting %d archives using %d threads", num_paths, nthreads);
+
+  pthread_mutex_init(&bi.mutex, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+  for(int i = 0; i < nthreads; i++)
+    pthread_create(&tids[i], NULL, bulk_ingest_thread, &bi);
+  for(int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_mutex_destroy(&bi.mutex);
+
+  double secs = end.tv_sec - start.tv_sec +
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+  if(secs <= 0)
+    secs = 1e-9;
+
+  msg(opaque, "Done: %d ingested, %d failed in %.1fs, "
+      "%.1f archives/s, %.2f MB/s",
+      bi.ok, bi.failed, secs, num_paths / secs, bi.bytes / 1e6 / secs);
+}
+
+
+/**
+ *
+ */
+static int
+ingest_dir(const char *user,
+           int argc, const char **argv, int *intv,
+           void (*msg)(void *opaque, const char *fmt, ...),
+           void *opaque)
+{
+  char path[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  char **paths = NULL;
+  int num_paths = 0, capacity = 0;
+
+  DIR *dir = opendir(argv[0]);
+  if(dir == NULL) {
+    msg(opaque, "Unable to open %s -- %s", argv[0], strerror(errno));
+    return 0;
+  }
+
+  while((de = readdir(dir)) != NULL) {
+    if(de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", argv[0], de->d_name);
+    if(stat(path, &st) || !S_ISREG(st.st_mode))
+      continue;
+    if(num_paths == capacity) {
+      capacity = capacity * 2 + 64;
+      paths = realloc(paths, capacity * sizeof(char *));
+    }
+    paths[num_paths++] = strdup(path);
+  }
+  closedir(dir);
+
+  if(num_paths == 0)
+    msg(opaque, "No files found in %s", argv[0]);
+  else
+    bulk_ingest_run(paths, num_paths, msg, opaque);
+
+  for(int i = 0; i < num_paths; i++)
+    free(paths[i]);
+  free(paths);
+  return 0;
+}
+
+
+CMD(ingest_dir,
+    CMD_LITERAL("ingest"),
+    CMD_LITERAL("dir"),
+    CMD_VARSTR("path")
+    );
+
+
+/**
+ * Ingest every path or URL listed, one per line, in a file
+ */
+static int
+ingest_list(const char *user,
+            int argc, const char **argv, int *intv,
+            void (*msg)(void *opaque, const char *fmt, ...),
+            void *opaque)
+{
+  char line[PATH_MAX];
+  char **paths = NULL;
+  int num_paths = 0, capacity = 0;
+
+  FILE *fp = fopen(argv[0], "r");
+  if(fp == NULL) {
+    msg(opaque, "Unable to open %s -- %s", argv[0], strerror(errno));
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    char *s = line + strspn(line, " \t");
+    s[strcspn(s, "\r\n")] = 0;
+    if(*s == 0 || *s == '#')
+      continue;
+    if(num_paths == capacity) {
+      capacity = capacity * 2 + 64;
+      paths = realloc(paths, capacity * sizeof(char *));
+    }
+    paths[num_paths++] = strdup(s);
+  }
+  fclose(fp);
+
+  if(num_paths == 0)
+    msg(opaque, "No archives listed in %s", argv[0]);
+  else
+    bulk_ingest_run(paths, num_paths, msg, opaque);
+
+  for(int i = 0; i < num_paths; i++)
+    free(paths[i]);
+  free(paths);
+  return 0;
+}
+
+
+CMD(ingest_list,
+    CMD_LITERAL("ingest"),
+    CMD_LITERAL("list"),
+    CMD_VARSTR("file")
+    );
@@ -0,0 +1,322 @@
+#include <sys/queue.h>
+#include <sys/random.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+
+#include "spmc.h"
+#include "ingestjob.h"
+#include "ingest.h"
+#include "jsonwriter.h"
+
+/**
+ * Ingests run on a small pool of worker threads so slow downloads and
+ * big archives don't tie up HTTP threads. Clients poll for the outcome
+ */
+typedef enum {
+  INGEST_JOB_QUEUED,
+  INGEST_JOB_RUNNING,
+  INGEST_JOB_DONE,
+  INGEST_JOB_FAILED,
+} ingest_job_state_t;
+
+static const char *ingest_job_state_str[] = {
+  [INGEST_JOB_QUEUED]  = "queued",
+  [INGEST_JOB_RUNNING] = "running",
+  [INGEST_JOB_DONE]    = "done",
+  [INGEST_JOB_FAILED]  = "failed",
+};
+
+TAILQ_HEAD(ingest_job_queue, ingest_job);
+
+typedef struct ingest_job {
+  TAILQ_ENTRY(ingest_job) link;      // All jobs, oldest first
+  TAILQ_ENTRY(ingest_job) run_link;  // Pending jobs
+  char id[INGEST_JOB_ID_LEN + 1];
+  ingest_job_state_t state;
+
+  char *url;
+  void *data;
+  size_t datalen;
+  int userid;
+  int flags;
+
+  // Message log, same lines the synchronous API used to return
+  char *log;
+  size_t loglen;
+  int loglines;
+
+  ingest_result_t result;
+  time_t created;
+  time_t started;
+  time_t finished;
+} ingest_job_t;
+
+static pthread_mutex_t ingest_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ingest_job_cond = PTHREAD_COND_INITIALIZER;
+static struct ingest_job_queue ingest_jobs =
+  TAILQ_HEAD_INITIALIZER(ingest_jobs);
+static struct ingest_job_queue ingest_job_pending =
+  TAILQ_HEAD_INITIALIZER(ingest_job_pending);
+static int ingest_job_num_pending;
+
+
+/**
+ *
+ */
+static void
+ingest_job_destroy(ingest_job_t *job)
+{
+  free(job->url);
+  free(job->data);
+  free(job->log);
+  free(job);
+}
+
+
+/**
+ * Forget finished jobs nobody has polled for in a while. Called with
+ * ingest_job_mutex held, from idle workers as well as on submit and
+ * status so logs don't linger once submissions stop
+ */
+static void
+ingest_job_expire(void)
+{
+  cfg_root(root);
+  const int retention =
+    cfg_get_int(root, CFG("ingest", "jobretention"), 3600);
+  const time_t cutoff = time(NULL) - retention;
+  ingest_job_t *job, *next;
+
+  for(job = TAILQ_FIRST(&ingest_jobs); job != NULL; job = next) {
+    next = TAILQ_NEXT(job, link);
+    if(job->finished && job->finished < cutoff) {
+      TAILQ_REMOVE(&ingest_jobs, job, link);
+      ingest_job_destroy(job);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static void
+ingest_job_msg(void *opaque, const char *fmt, ...)
+{
+  ingest_job_t *job = opaque;
+  char buf[1024];
+  va_list ap;
+
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if(len >= sizeof(buf))
+    len = sizeof(buf) - 1;
+
+  pthread_mutex_lock(&ingest_job_mutex);
+  job->log = realloc(job->log, job->loglen + len + 2);
+  memcpy(job->log + job->loglen, buf, len);
+  job->loglen += len;
+  job->log[job->loglen++] = '\n';
+  job->log[job->loglen] = 0;
+  job->loglines++;
+  pthread_mutex_unlock(&ingest_job_mutex);
+}
+
+
+/**
+ *
+ */
+static void *
+ingest_job_worker(void *aux)
+{
+  ingest_job_t *job;
+
+  pthread_mutex_lock(&ingest_job_mutex);
+  while(1) {
+    while((job = TAILQ_FIRST(&ingest_job_pending)) == NULL) {
+      struct timespec ts = {.tv_sec = time(NULL) + 60};
+      if(pthread_cond_timedwait(&ingest_job_cond, &ingest_job_mutex,
+                                &ts) == ETIMEDOUT)
+        ingest_job_expire();
+    }
+
+    TAILQ_REMOVE(&ingest_job_pending, job, run_link);
+    ingest_job_num_pending--;
+    job->state = INGEST_JOB_RUNNING;
+    job->started = time(NULL);
+    pthread_mutex_unlock(&ingest_job_mutex);
+
+    int r;
+    if(job->url != NULL)
+      r = ingest_zip_from_url(job->url, ingest_job_msg, job,
+                              job->userid, job->flags, &job->result);
+    else
+      r = ingest_zip_from_memory(job->data, job->datalen, ingest_job_msg, job,
+                                 job->userid, job->flags, &job->result, NULL);
+
+    pthread_mutex_lock(&ingest_job_mutex);
+    free(job->data);
+    job->data = NULL;
+    job->state = r ? INGEST_JOB_FAILED : INGEST_JOB_DONE;
+    job->finished = time(NULL);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+ingest_job_submit(ingest_job_t *job, char id[INGEST_JOB_ID_LEN + 1])
+{
+  cfg_root(root);
+  const int maxpending = cfg_get_int(root, CFG("ingest", "queuesize"), 16);
+  uint8_t rnd[INGEST_JOB_ID_LEN / 2];
+
+  // The id is all that protects the job log, so it must not be guessable
+  if(getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+    trace(LOG_ERR, "Unable to generate ingest job id -- %s",
+          strerror(errno));
+    ingest_job_destroy(job);
+    return -1;
+  }
+  bin2hex(job->id, sizeof(job->id), rnd, sizeof(rnd));
+
+  pthread_mutex_lock(&ingest_job_mutex);
+
+  ingest_job_expire();
+
+  if(ingest_job_num_pending >= maxpending) {
+    pthread_mutex_unlock(&ingest_job_mutex);
+    ingest_job_destroy(job);
+    return -1;
+  }
+
+  strcpy(id, job->id);
+
+  job->state = INGEST_JOB_QUEUED;
+  job->created = time(NULL);
+  TAILQ_INSERT_TAIL(&ingest_jobs, job, link);
+  TAILQ_INSERT_TAIL(&ingest_job_pending, job, run_link);
+  ingest_job_num_pending++;
+  pthread_cond_signal(&ingest_job_cond);
+
+  pthread_mutex_unlock(&ingest_job_mutex);
+  return 0;
+}
+
+
+/**
+ * Queue an ingest from a URL. Returns -1 if the queue is full
+ */
+int
+ingest_job_submit_url(const char *url, int userid, int flags,
+                      char id[INGEST_JOB_ID_LEN + 1])
+{
+  ingest_job_t *job = calloc(1, sizeof(ingest_job_t));
+  job->url = strdup(url);
+  job->userid = userid;
+  job->flags = flags;
+  return ingest_job_submit(job, id);
+}
+
+
+/**
+ * Queue an ingest of an uploaded archive, 'data' is copied. Unlike URL
+ * ingests the whole upload is held in memory until the job is done
+ */
+int
+ingest_job_submit_data(const void *data, size_t datalen,
+                       int userid, int flags,
+                       char id[INGEST_JOB_ID_LEN + 1])
+{
+  ingest_job_t *job = calloc(1, sizeof(ingest_job_t));
+  job->data = malloc(datalen);
+  memcpy(job->data, data, datalen);
+  job->datalen = datalen;
+  job->userid = userid;
+  job->flags = flags;
+  return ingest_job_submit(job, id);
+}
+
+
+/**
+ * Render job status as JSON. Only the submitting user, or an admin, may
+ * see a job. Returns -1 if the job is unknown to the caller
+ */
+int
+ingest_job_status(const char *id, int userid, int flags, htsbuf_queue_t *out)
+{
+  ingest_job_t *job;
+  jsonwriter_t jw;
+
+  pthread_mutex_lock(&ingest_job_mutex);
+
+  ingest_job_expire();
+
+  TAILQ_FOREACH(job, &ingest_jobs, link)
+    if(!strcmp(job->id, id))
+      break;
+
+  if(job == NULL ||
+     (job->userid != userid && !(flags & SPMC_USER_ADMIN))) {
+    pthread_mutex_unlock(&ingest_job_mutex);
+    return -1;
+  }
+
+  jw_init(&jw, out);
+  jw_begin_map(&jw, NULL);
+  jw_str(&jw, "job", job->id);
+  jw_str(&jw, "state", ingest_job_state_str[job->state]);
+  jw_u32(&jw, "created", job->created);
+  if(job->started)
+    jw_u32(&jw, "started", job->started);
+  if(job->finished) {
+    jw_u32(&jw, "finished", job->finished);
+    jw_u32(&jw, "error", job->state == INGEST_JOB_FAILED);
+  }
+  if(job->state == INGEST_JOB_DONE) {
+    jw_str(&jw, "pluginid", job->result.pluginid);
+    jw_str(&jw, "version", job->result.version);
+  }
+  jw_u32(&jw, "loglines", job->loglines);
+  jw_str(&jw, "result", job->log ?: "");
+  jw_end_map(&jw);
+
+  pthread_mutex_unlock(&ingest_job_mutex);
+  return 0;
+}
+
+
+/**
+ *
+ */
+void
+ingest_job_init(void)
+{
+  cfg_root(root);
+  int workers = cfg_get_int(root, CFG("ingest", "workers"), 2);
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  if(workers < 1)
+    workers = 1;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for(int i = 0; i < workers; i++)
+    pthread_create(&tid, &attr, ingest_job_worker, NULL);
+  pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "libsvc/htsbuf.h"
+
+#define INGEST_JOB_ID_LEN 16
+
+int ingest_job_submit_url(const char *url, int userid, int flags,
+                          char id[INGEST_JOB_ID_LEN + 1]);
+
+int ingest_job_submit_data(const void *data, size_t datalen,
+                           int userid, int flags,
+                           char id[INGEST_JOB_ID_LEN + 1]);
+
+int ingest_job_status(const char *id, int userid, int flags,
+                      htsbuf_queue_t *out);
+
+void ingest_job_init(void);
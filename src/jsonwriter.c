@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "jsonwriter.h"
+
+
+/**
+ *
+ */
+void
+jw_init(jsonwriter_t *jw, htsbuf_queue_t *hq)
+{
+  jw->hq = hq;
+  jw->depth = 0;
+  jw->first[0] = 1;
+}
+
+
+/**
+ *
+ */
+static void
+jw_escape(htsbuf_queue_t *hq, const char *str)
+{
+  const char *s = str;
+  char tmp[8];
+
+  htsbuf_append(hq, "\"", 1);
+
+  while(*s) {
+    const unsigned char c = *s;
+    const char *esc;
+
+    switch(c) {
+    case '"':  esc = "\\\""; break;
+    case '\\': esc = "\\\\"; break;
+    case '\n': esc = "\\n";  break;
+    case '\r': esc = "\\r";  break;
+    case '\t': esc = "\\t";  break;
+    case '\b': esc = "\\b";  break;
+    case '\f': esc = "\\f";  break;
+    default:
+      if(c >= 0x20) {
+        s++;
+        continue;
+      }
+      snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+      esc = tmp;
+      break;
+    }
+
+    // Flush the run of characters that did not need escaping
+    htsbuf_append(hq, str, s - str);
+    htsbuf_append(hq, esc, strlen(esc));
+    str = ++s;
+  }
+  htsbuf_append(hq, str, s - str);
+  htsbuf_append(hq, "\"", 1);
+}
+
+
+/**
+ * Emit separator and key for a new value at the current level
+ */
+static void
+jw_value_prefix(jsonwriter_t *jw, const char *key)
+{
+  if(!jw->first[jw->depth])
+    htsbuf_append(jw->hq, ",", 1);
+  jw->first[jw->depth] = 0;
+
+  if(key != NULL) {
+    jw_escape(jw->hq, key);
+    htsbuf_append(jw->hq, ":", 1);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+jw_push(jsonwriter_t *jw, const char *key, const char *open)
+{
+  jw_value_prefix(jw, key);
+  htsbuf_append(jw->hq, open, 1);
+  if(jw->depth < JW_MAX_DEPTH - 1)
+    jw->depth++;
+  jw->first[jw->depth] = 1;
+}
+
+
+/**
+ *
+ */
+static void
+jw_pop(jsonwriter_t *jw, const char *close)
+{
+  htsbuf_append(jw->hq, close, 1);
+  if(jw->depth > 0)
+    jw->depth--;
+}
+
+
+/**
+ *
+ */
+void
+jw_begin_map(jsonwriter_t *jw, const char *key)
+{
+  jw_push(jw, key, "{");
+}
+
+
+/**
+ *
+ */
+void
+jw_end_map(jsonwriter_t *jw)
+{
+  jw_pop(jw, "}");
+}
+
+
+/**
+ *
+ */
+void
+jw_begin_list(jsonwriter_t *jw, const char *key)
+{
+  jw_push(jw, key, "[");
+}
+
+
+/**
+ *
+ */
+void
+jw_end_list(jsonwriter_t *jw)
+{
+  jw_pop(jw, "]");
+}
+
+
+/**
+ *
+ */
+void
+jw_str(jsonwriter_t *jw, const char *key, const char *str)
+{
+  jw_value_prefix(jw, key);
+  jw_escape(jw->hq, str ?: "");
+}
+
+
+/**
+ *
+ */
+void
+jw_u32(jsonwriter_t *jw, const char *key, uint32_t u32)
+{
+  jw_value_prefix(jw, key);
+  htsbuf_qprintf(jw->hq, "%u", u32);
+}
+
+
+/**
+ *
+ */
+void
+jw_s64(jsonwriter_t *jw, const char *key, int64_t s64)
+{
+  jw_value_prefix(jw, key);
+  htsbuf_qprintf(jw->hq, "%"PRId64, s64);
+}
+
+
+/**
+ * Emit an already serialized JSON value
+ */
+void
+jw_raw(jsonwriter_t *jw, const char *key, const char *json, size_t len)
+{
+  jw_value_prefix(jw, key);
+  htsbuf_append(jw->hq, json, len);
+}
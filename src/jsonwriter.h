@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "libsvc/htsbuf.h"
+
+#define JW_MAX_DEPTH 16
+
+/**
+ * Streaming JSON emitter writing straight into a htsbuf queue.
+ *
+ * 'key' must be given for values inside a map and must be NULL
+ * for values inside a list (or at top level)
+ */
+typedef struct jsonwriter {
+  htsbuf_queue_t *hq;
+  int depth;
+  char first[JW_MAX_DEPTH];
+} jsonwriter_t;
+
+void jw_init(jsonwriter_t *jw, htsbuf_queue_t *hq);
+
+void jw_begin_map(jsonwriter_t *jw, const char *key);
+
+void jw_end_map(jsonwriter_t *jw);
+
+void jw_begin_list(jsonwriter_t *jw, const char *key);
+
+void jw_end_list(jsonwriter_t *jw);
+
+void jw_str(jsonwriter_t *jw, const char *key, const char *str);
+
+void jw_u32(jsonwriter_t *jw, const char *key, uint32_t u32);
+
+void jw_s64(jsonwriter_t *jw, const char *key, int64_t s64);
+
+void jw_raw(jsonwriter_t *jw, const char *key, const char *json, size_t len);
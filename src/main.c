@@ -27,6 +27,12 @@
 #include "restapi.h"
 #include "stash.h"
 #include "events.h"
+#include "catalog.h"
+#include "geoip.h"
+#include "downloads.h"
+#include "scrub.h"
+#include "gc.h"
+#include "ingestjob.h"
 
 static int running = 1;
 static int reload = 0;
@@ -119,6 +125,8 @@ main(int argc, char **argv)
 
   libsvc_init();
 
+  stash_remove_tmpfiles();
+
   http_init();
 
   if(db_upgrade_schema("sql")) {
@@ -130,12 +138,24 @@ main(int argc, char **argv)
 
   event_init();
 
+  geoip_init();
+
+  catalog_init();
+
   showtime_init();
 
+  ingest_job_init();
+
   restapi_init();
 
+  downloads_init();
+
   stash_init();
 
+  scrub_init();
+
+  gc_init();
+
   running = 1;
   sigemptyset(&set);
   sigaddset(&set, SIGTERM);
@@ -158,10 +178,70 @@ main(int argc, char **argv)
     pause();
   }
 
+  downloads_fini();
+
   return 0;
 }
 
 
+/**
+ * FNV-1a
+ */
+uint32_t
+strhash(const char *str)
+{
+  uint32_t h = 2166136261u;
+  while(*str) {
+    h ^= (uint8_t)*str++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+/**
+ * Check if 'token' is an element of the comma separated 'list'
+ */
+int
+csv_contains(const char *list, const char *token)
+{
+  const size_t len = strlen(token);
+
+  while(list != NULL && *list) {
+    const char *end = strchr(list, ',');
+    const size_t elen = end ? end - list : strlen(list);
+    if(elen == len && !strncmp(list, token, len))
+      return 1;
+    list = end ? end + 1 : NULL;
+  }
+  return 0;
+}
+
+
+/**
+ * Parse a 40 character lower case hex SHA1 digest
+ */
+int
+digest_parse(uint8_t out[20], const char *str)
+{
+  for(int i = 0; i < 40; i++) {
+    const char c = str[i];
+    int v;
+    if(c >= '0' && c <= '9')
+      v = c - '0';
+    else if(c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return -1;
+    if(i & 1)
+      out[i / 2] |= v;
+    else
+      out[i / 2] = v << 4;
+  }
+  return str[40] == 0 ? 0 : -1;
+}
+
+
 uint32_t
 parse_version_int(const char *str)
 {
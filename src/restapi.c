@@ -13,10 +13,10 @@
 #include "restapi.h"
 #include "spmc.h"
 #include "ingest.h"
+#include "ingestjob.h"
 #include "events.h"
-
-#define API_NO_DATA ((htsmsg_t *)-1)
-#define API_ERROR   NULL
+#include "catalog.h"
+#include "jsonwriter.h"
 
 #define PUBLIC_PLUGIN_FIELDS "plugin_id, version.created,version,type,author,downloads,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,published,comment,status,plugin.userid"
 
@@ -24,10 +24,10 @@
 
 
 /**
- *
+ * Stream one row as a JSON map. Returns 1 when there are no more rows
  */
-static htsmsg_t *
-public_plugin_to_htsmsg(db_stmt_t *q, const char *baseurl)
+static int
+public_plugin_to_json(db_stmt_t *q, const char *baseurl, jsonwriter_t *jw)
 {
   char plugin_id[128];
   time_t created;
@@ -69,11 +69,8 @@ public_plugin_to_htsmsg(db_stmt_t *q, const char *baseurl)
                         DB_RESULT_STRING(status),
                         DB_RESULT_INT(userid));
 
-  if(r < 0)
-    return NULL;
-
   if(r)
-    return API_NO_DATA;
+    return r;
 
   utf8_cleanup_inplace(author,      sizeof(author));
   utf8_cleanup_inplace(title,       sizeof(title));
@@ -81,40 +78,41 @@ public_plugin_to_htsmsg(db_stmt_t *q, const char *baseurl)
   utf8_cleanup_inplace(description, sizeof(description));
   utf8_cleanup_inplace(comment,     sizeof(comment));
 
-  htsmsg_t *m = htsmsg_create_map();
-
-  htsmsg_add_str(m, "id",            plugin_id);
-  htsmsg_add_str(m, "version",       version);
-  htsmsg_add_u32(m, "created",       created);
-  htsmsg_add_str(m, "type",          type);
-  htsmsg_add_str(m, "author",        author);
-  htsmsg_add_u32(m, "downloads",     downloads);
-  htsmsg_add_str(m, "showtime_min_version", showtime_min_version);
-  htsmsg_add_str(m, "title",         title);
-  htsmsg_add_str(m, "category",      category);
-  htsmsg_add_str(m, "synopsis",      synopsis);
-  htsmsg_add_str(m, "description",   description);
-  htsmsg_add_str(m, "homepage",      homepage);
+  jw_begin_map(jw, NULL);
+
+  jw_str(jw, "id",            plugin_id);
+  jw_str(jw, "version",       version);
+  jw_u32(jw, "created",       created);
+  jw_str(jw, "type",          type);
+  jw_str(jw, "author",        author);
+  jw_u32(jw, "downloads",     downloads);
+  jw_str(jw, "showtime_min_version", showtime_min_version);
+  jw_str(jw, "title",         title);
+  jw_str(jw, "category",      category);
+  jw_str(jw, "synopsis",      synopsis);
+  jw_str(jw, "description",   description);
+  jw_str(jw, "homepage",      homepage);
 
   if(*icon_digest) {
     snprintf(url, sizeof(url), "%s/data/%s", baseurl, icon_digest);
-    htsmsg_add_str(m, "icon", url);
+    jw_str(jw, "icon", url);
   }
 
-  htsmsg_add_u32(m, "published",     published);
-  htsmsg_add_str(m, "comment",       comment);
-  htsmsg_add_str(m, "status",        status);
-  htsmsg_add_u32(m, "userid",        userid);
-  return m;
+  jw_u32(jw, "published",     published);
+  jw_str(jw, "comment",       comment);
+  jw_str(jw, "status",        status);
+  jw_u32(jw, "userid",        userid);
+  jw_end_map(jw);
+  return 0;
 }
 
 
 
 /**
- *
+ * Stream one row as a JSON map. Returns 1 when there are no more rows
  */
-static htsmsg_t *
-version_to_htsmsg(db_stmt_t *q, const char *baseurl)
+static int
+version_to_json(db_stmt_t *q, const char *baseurl, jsonwriter_t *jw)
 {
   char plugin_id[128];
   time_t created;
@@ -154,11 +152,8 @@ version_to_htsmsg(db_stmt_t *q, const char *baseurl)
                         DB_RESULT_STRING(comment),
                         DB_RESULT_STRING(status));
 
-  if(r < 0)
-    return NULL;
-
   if(r)
-    return API_NO_DATA;
+    return r;
 
   utf8_cleanup_inplace(author,      sizeof(author));
   utf8_cleanup_inplace(title,       sizeof(title));
@@ -166,30 +161,31 @@ version_to_htsmsg(db_stmt_t *q, const char *baseurl)
   utf8_cleanup_inplace(description, sizeof(description));
   utf8_cleanup_inplace(comment,     sizeof(comment));
 
-  htsmsg_t *m = htsmsg_create_map();
-
-  htsmsg_add_str(m, "id",            version);
-  htsmsg_add_str(m, "version",       version);
-  htsmsg_add_u32(m, "created",       created);
-  htsmsg_add_str(m, "type",          type);
-  htsmsg_add_str(m, "author",        author);
-  htsmsg_add_u32(m, "downloads",     downloads);
-  htsmsg_add_str(m, "showtime_min_version", showtime_min_version);
-  htsmsg_add_str(m, "title",         title);
-  htsmsg_add_str(m, "category",      category);
-  htsmsg_add_str(m, "synopsis",      synopsis);
-  htsmsg_add_str(m, "description",   description);
-  htsmsg_add_str(m, "homepage",      homepage);
+  jw_begin_map(jw, NULL);
+
+  jw_str(jw, "id",            version);
+  jw_str(jw, "version",       version);
+  jw_u32(jw, "created",       created);
+  jw_str(jw, "type",          type);
+  jw_str(jw, "author",        author);
+  jw_u32(jw, "downloads",     downloads);
+  jw_str(jw, "showtime_min_version", showtime_min_version);
+  jw_str(jw, "title",         title);
+  jw_str(jw, "category",      category);
+  jw_str(jw, "synopsis",      synopsis);
+  jw_str(jw, "description",   description);
+  jw_str(jw, "homepage",      homepage);
 
   if(*icon_digest) {
     snprintf(url, sizeof(url), "%s/data/%s", baseurl, icon_digest);
-    htsmsg_add_str(m, "icon", url);
+    jw_str(jw, "icon", url);
   }
 
-  htsmsg_add_u32(m, "published",     published);
-  htsmsg_add_str(m, "comment",       comment);
-  htsmsg_add_str(m, "status",        status);
-  return m;
+  jw_u32(jw, "published",     published);
+  jw_str(jw, "comment",       comment);
+  jw_str(jw, "status",        status);
+  jw_end_map(jw);
+  return 0;
 }
 
 
@@ -272,21 +268,21 @@ do_plugins(http_connection_t *hc, int qtype)
     return http_output_content(hc, "text/plain");
   }
 
-  htsmsg_t *list = htsmsg_create_list();
+  jsonwriter_t jw;
+  jw_init(&jw, &hc->hc_reply);
+  jw_begin_list(&jw, NULL);
 
   while(1) {
-    htsmsg_t *m = public_plugin_to_htsmsg(q, baseurl);
-    if(m == NULL)
+    int r = public_plugin_to_json(q, baseurl, &jw);
+    if(r < 0) {
+      htsbuf_queue_flush(&hc->hc_reply);
       return 500;
-    if(m == API_NO_DATA)
-       break;
-    htsmsg_add_msg(list, NULL, m);
+    }
+    if(r)
+      break;
   }
 
-  char *json = htsmsg_json_serialize_to_str(list, 1);
-  htsmsg_destroy(list);
-
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
+  jw_end_list(&jw);
   return http_output_content(hc, "application/json");
 }
 
@@ -390,6 +386,8 @@ plugins(http_connection_t *hc, int argc, char **argv, int flags)
     if(db_stmt_exec(s, "sss", betasecret, dlurl, id))
       return 500;
 
+    catalog_invalidate();
+
     m = htsmsg_create_map();
     break;
 
@@ -433,20 +431,21 @@ versions(http_connection_t *hc, int argc, char **argv, int flags)
   if(db_stmt_exec(s, "s", id))
     return 500;
 
-  htsmsg_t *list = htsmsg_create_list();
+  jsonwriter_t jw;
+  jw_init(&jw, &hc->hc_reply);
+  jw_begin_list(&jw, NULL);
 
   while(1) {
-    htsmsg_t *m = version_to_htsmsg(s, baseurl);
-    if(m == NULL)
+    int r = version_to_json(s, baseurl, &jw);
+    if(r < 0) {
+      htsbuf_queue_flush(&hc->hc_reply);
       return 500;
-    if(m == API_NO_DATA)
-       break;
-    htsmsg_add_msg(list, NULL, m);
+    }
+    if(r)
+      break;
   }
-  char *json = htsmsg_json_serialize_to_str(list, 1);
-  htsmsg_destroy(list);
 
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
+  jw_end_list(&jw);
   return http_output_content(hc, "application/json");
 }
 
@@ -475,7 +474,9 @@ version(http_connection_t *hc, int argc, char **argv, int flags)
   const char *id = argv[1];
   const char *version = argv[2];
 
-  htsmsg_t *m;
+  jsonwriter_t jw;
+  jw_init(&jw, &hc->hc_reply);
+  int r;
 
   switch(hc->hc_cmd) {
   case HTTP_CMD_DELETE:
@@ -487,8 +488,10 @@ version(http_connection_t *hc, int argc, char **argv, int flags)
     if(db_stmt_exec(s, "ss", id, version))
       return 500;
 
+    catalog_invalidate();
     event_add(c, id, userid, "Deleted %s", version);
-    m = htsmsg_create_map();
+    jw_begin_map(&jw, NULL);
+    jw_end_map(&jw);
     break;
 
   case HTTP_CMD_GET:
@@ -501,23 +504,18 @@ version(http_connection_t *hc, int argc, char **argv, int flags)
     if(db_stmt_exec(s, "ss", id, version))
       return 500;
 
-    m = version_to_htsmsg(s, baseurl);
-    if(m == NULL)
-      return 500;
-    if(m == API_NO_DATA)
-      return 404;
-
+    r = version_to_json(s, baseurl, &jw);
     db_stmt_reset(s);
+    if(r) {
+      htsbuf_queue_flush(&hc->hc_reply);
+      return r < 0 ? 500 : 404;
+    }
     break;
 
   default:
     return 405;
   }
 
-  char *json = htsmsg_json_serialize_to_str(m, 1);
-  htsmsg_destroy(m);
-
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
   return http_output_content(hc, "application/json");
 }
 
@@ -580,34 +578,18 @@ pv_action(http_connection_t *hc, int argc, char **argv, int flags)
   }
   event_add(c, id, userid, "%s %s", info, version);
   db_commit(c);
+  catalog_invalidate();
   return 200;
 }
 
 /**
- *
- */
-static void
-write_to_file(void *opaque, const char *fmt, ...)
-{
-  va_list ap;
-  va_start(ap, fmt);
-  vfprintf(opaque, fmt, ap);
-  fprintf(opaque, "\n");
-  va_end(ap);
-}
-
-
-
-/**
- *
+ * Queue an ingest, the reply only carries the job id. Poll
+ * /api/ingest/<job>.json for its state, log and outcome
  */
 static int
 ingest(http_connection_t *hc, int argc, char **argv, int flags)
 {
-  FILE *f;
-  ingest_result_t result;
-  char *out = NULL;
-  size_t outlen = 0;
+  char id[INGEST_JOB_ID_LEN + 1];
   int r;
 
   const char *url = http_arg_get(&hc->hc_req_args, "url");
@@ -616,41 +598,42 @@ ingest(http_connection_t *hc, int argc, char **argv, int flags)
   if(userid == 0)
     return 400;
 
-
-  f = open_memstream(&out, &outlen);
-
   if(url != NULL) {
-    r = ingest_zip_from_url(url, write_to_file, f, userid,
-                            admin ? SPMC_USER_ADMIN : 0,
-                            &result);
-  } else if(!strcmp(hc->hc_content_type, "application/octet-stream")) {
-    r = ingest_zip_from_memory(hc->hc_post_data, hc->hc_post_len,
-                               write_to_file, f, userid,
-                               admin ? SPMC_USER_ADMIN : 0,
-                               &result, NULL);
-
+    r = ingest_job_submit_url(url, userid, admin ? SPMC_USER_ADMIN : 0, id);
+  } else if(hc->hc_content_type != NULL &&
+            !strcmp(hc->hc_content_type, "application/octet-stream")) {
+    r = ingest_job_submit_data(hc->hc_post_data, hc->hc_post_len,
+                               userid, admin ? SPMC_USER_ADMIN : 0, id);
   } else {
-    fclose(f);
     return 400;
   }
 
-  fwrite("", 1, 1, f);
-  fclose(f);
+  if(r)
+    return 503;
 
-  htsmsg_t *m = htsmsg_create_map();
+  jsonwriter_t jw;
+  jw_init(&jw, &hc->hc_reply);
+  jw_begin_map(&jw, NULL);
+  jw_str(&jw, "job", id);
+  jw_end_map(&jw);
+  return http_output_content(hc, "application/json");
+}
 
-  htsmsg_add_u32(m, "error", !!r);
-  htsmsg_add_str(m, "result", out);
-  if(!r) {
-    htsmsg_add_str(m, "pluginid", result.pluginid);
-    htsmsg_add_str(m, "version",  result.version);
-  }
-  free(out);
 
-  char *json = htsmsg_json_serialize_to_str(m, 1);
-  htsmsg_destroy(m);
+/**
+ *
+ */
+static int
+ingest_status(http_connection_t *hc, int argc, char **argv, int flags)
+{
+  int userid = http_arg_get_int(&hc->hc_req_args, "userid", 0);
+  int admin = http_arg_get_int(&hc->hc_req_args, "admin", 0);
+  if(userid == 0)
+    return 400;
 
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
+  if(ingest_job_status(argv[1], userid, admin ? SPMC_USER_ADMIN : 0,
+                       &hc->hc_reply))
+    return 404;
   return http_output_content(hc, "application/json");
 }
 
@@ -714,7 +697,10 @@ events(http_connection_t *hc, int argc, char **argv, int flags)
     return http_output_content(hc, "text/plain");
   }
 
-  htsmsg_t *list = htsmsg_create_list();
+  jsonwriter_t jw;
+  jw_init(&jw, &hc->hc_reply);
+  jw_begin_list(&jw, NULL);
+
   while(1) {
     time_t created;
     int uid;
@@ -727,22 +713,20 @@ events(http_connection_t *hc, int argc, char **argv, int flags)
                             DB_RESULT_STRING(pid),
                             DB_RESULT_STRING(info));
       if(r < 0) {
-        htsmsg_destroy(list);
+        htsbuf_queue_flush(&hc->hc_reply);
         return 500;
       }
       if(r)
         break;
-      htsmsg_t *m = htsmsg_create_map();
-      htsmsg_add_u32(m, "created", created);
-      htsmsg_add_u32(m, "userid", uid);
-      htsmsg_add_str(m, "pluginid", pid);
-      htsmsg_add_str(m, "info", info);
-      htsmsg_add_msg(list, NULL, m);
+      jw_begin_map(&jw, NULL);
+      jw_u32(&jw, "created", created);
+      jw_u32(&jw, "userid", uid);
+      jw_str(&jw, "pluginid", pid);
+      jw_str(&jw, "info", info);
+      jw_end_map(&jw);
   }
 
-  char *json = htsmsg_json_serialize_to_str(list, 1);
-  htsmsg_destroy(list);
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
+  jw_end_list(&jw);
   return http_output_content(hc, "application/json");
 }
 
@@ -755,6 +739,7 @@ void
 restapi_init(void)
 {
   http_route_add("/api/ingest$", ingest, 0);
+  http_route_add("/api/ingest/([0-9a-f]+).json$", ingest_status, 0);
 
   http_path_add("/api/plugins.json",  NULL, plugins_json);
   http_path_add("/api/plugins.count", NULL, plugins_count);
@@ -0,0 +1,353 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <openssl/sha.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/cmd.h"
+
+#include "scrub.h"
+#include "stash.h"
+
+/**
+ * Background re-verification of stash objects against their names.
+ * Objects whose content no longer matches are moved to
+ * <stashdir>/quarantine so they are never served again
+ */
+#define SCRUB_BLOCKSIZE (1024 * 1024)
+
+static pthread_mutex_t scrub_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static int scrub_kick;
+
+// Protected by scrub_mutex
+static struct {
+  int running;
+  int shard;
+  unsigned int passes;
+  time_t pass_started;
+  time_t last_pass;
+  unsigned int objects;
+  unsigned int corrupt;
+  unsigned int total_corrupt;
+  int64_t bytes;
+} scrub_stats;
+
+
+/**
+ * Sleep until 'deadline' or until someone asks for a scrub right now.
+ * Returns 1 if kicked
+ */
+static int
+scrub_sleep(const struct timespec *deadline)
+{
+  int kicked;
+  pthread_mutex_lock(&scrub_mutex);
+  while(!scrub_kick &&
+        pthread_cond_timedwait(&scrub_cond, &scrub_mutex,
+                               deadline) != ETIMEDOUT) {}
+  kicked = scrub_kick;
+  scrub_kick = 0;
+  pthread_mutex_unlock(&scrub_mutex);
+  return kicked;
+}
+
+
+/**
+ * Keep the average read rate of the current pass below 'rate' bytes
+ * per second by sleeping whenever we are ahead
+ */
+static void
+scrub_throttle(const struct timespec *start, int64_t bytes, int64_t rate)
+{
+  struct timespec now, until;
+
+  if(rate <= 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const int64_t due_ns = bytes * 1000000000LL / rate;
+  const int64_t spent_ns = (now.tv_sec - start->tv_sec) * 1000000000LL +
+    now.tv_nsec - start->tv_nsec;
+
+  if(spent_ns >= due_ns)
+    return;
+
+  const int64_t sleep_ns = due_ns - spent_ns;
+  until.tv_sec = sleep_ns / 1000000000LL;
+  until.tv_nsec = sleep_ns % 1000000000LL;
+  while(nanosleep(&until, &until) == -1 && errno == EINTR) {}
+}
+
+
+/**
+ *
+ */
+static void
+scrub_quarantine(const char *stashdir, const char *path, const char *digest,
+                 const char *actual)
+{
+  char qpath[PATH_MAX];
+
+  trace(LOG_ERR, "Stash object %s is corrupt (content hashes to %s), "
+        "moving it to quarantine", digest, actual);
+
+  snprintf(qpath, sizeof(qpath), "%s/quarantine", stashdir);
+  if(makedirs(qpath)) {
+    trace(LOG_ERR, "Unable to mkdir('%s') -- %s", qpath, strerror(errno));
+    return;
+  }
+
+  snprintf(qpath, sizeof(qpath), "%s/quarantine/%s", stashdir, digest);
+  if(rename(path, qpath)) {
+    trace(LOG_ERR, "Unable to rename('%s', '%s') -- %s",
+          path, qpath, strerror(errno));
+    return;
+  }
+  stash_forget(digest);
+}
+
+
+/**
+ * Returns the number of bytes read
+ */
+static int64_t
+scrub_object(const char *stashdir, const char *digest, uint8_t *buf,
+             const struct timespec *start, int64_t done, int64_t rate)
+{
+  char path[PATH_MAX];
+  char actual[41];
+  uint8_t md[20];
+  SHA_CTX ctx;
+  int64_t total = 0;
+
+  snprintf(path, sizeof(path), "%s/%.2s/%s", stashdir, digest, digest);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return 0; // Removed while we were scanning
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  SHA1_Init(&ctx);
+
+  while(1) {
+    ssize_t r = read(fd, buf, SCRUB_BLOCKSIZE);
+    if(r == -1 && errno == EINTR)
+      continue;
+    if(r == -1) {
+      trace(LOG_ERR, "Unable to read '%s' -- %s", path, strerror(errno));
+      close(fd);
+      return total;
+    }
+    if(r == 0)
+      break;
+    SHA1_Update(&ctx, buf, r);
+    total += r;
+    scrub_throttle(start, done + total, rate);
+  }
+  close(fd);
+
+  SHA1_Final(md, &ctx);
+  bin2hex(actual, sizeof(actual), md, 20);
+
+  if(strcmp(actual, digest)) {
+    scrub_quarantine(stashdir, path, digest, actual);
+    pthread_mutex_lock(&scrub_mutex);
+    scrub_stats.corrupt++;
+    scrub_stats.total_corrupt++;
+    pthread_mutex_unlock(&scrub_mutex);
+  }
+  return total;
+}
+
+
+/**
+ *
+ */
+static void
+scrub_pass(const char *stashdir, int64_t rate)
+{
+  char path[PATH_MAX];
+  struct timespec start;
+  struct dirent *de;
+  int64_t done = 0;
+  uint8_t *buf = malloc(SCRUB_BLOCKSIZE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&scrub_mutex);
+  scrub_stats.running = 1;
+  scrub_stats.pass_started = time(NULL);
+  scrub_stats.objects = 0;
+  scrub_stats.corrupt = 0;
+  scrub_stats.bytes = 0;
+  pthread_mutex_unlock(&scrub_mutex);
+
+  for(int shard = 0; shard < 256; shard++) {
+
+    pthread_mutex_lock(&scrub_mutex);
+    scrub_stats.shard = shard;
+    pthread_mutex_unlock(&scrub_mutex);
+
+    snprintf(path, sizeof(path), "%s/%02x", stashdir, shard);
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+      continue;
+
+    while((de = readdir(dir)) != NULL) {
+      if(strlen(de->d_name) != 40 ||
+         strspn(de->d_name, "0123456789abcdef") != 40)
+        continue;
+
+      const int64_t n = scrub_object(stashdir, de->d_name, buf,
+                                     &start, done, rate);
+      done += n;
+
+      pthread_mutex_lock(&scrub_mutex);
+      scrub_stats.objects++;
+      scrub_stats.bytes += n;
+      pthread_mutex_unlock(&scrub_mutex);
+    }
+    closedir(dir);
+  }
+  free(buf);
+
+  pthread_mutex_lock(&scrub_mutex);
+  scrub_stats.running = 0;
+  scrub_stats.passes++;
+  scrub_stats.last_pass = time(NULL);
+  trace(LOG_INFO, "Stash scrub done, %u objects, %"PRId64" bytes in %ds, "
+        "%u corrupt", scrub_stats.objects, scrub_stats.bytes,
+        (int)(scrub_stats.last_pass - scrub_stats.pass_started),
+        scrub_stats.corrupt);
+  pthread_mutex_unlock(&scrub_mutex);
+}
+
+
+/**
+ *
+ */
+static void *
+scrub_thread(void *aux)
+{
+  struct timespec deadline;
+
+  while(1) {
+    // Sleep first so a restart does not put a full pass on top of the
+    // stash index scan. 'scrub start' still runs one right away
+    {
+      cfg_root(root);
+      const int rate = cfg_get_int(root, CFG("stash", "scrub", "rate"), 10);
+      const int interval =
+        cfg_get_int(root, CFG("stash", "scrub", "interval"), 86400);
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += rate > 0 ? interval : 3600;
+    }
+    const int kicked = scrub_sleep(&deadline);
+
+    cfg_root(root);
+    const char *stashdir = cfg_get_str(root, CFG("stashdir"), NULL);
+    const int rate = cfg_get_int(root, CFG("stash", "scrub", "rate"), 10);
+
+    if(stashdir != NULL && (rate > 0 || kicked)) {
+      char *dir = strdup(stashdir);
+      scrub_pass(dir, rate > 0 ? rate * 1000000LL : 0);
+      free(dir);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+scrub_init(void)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, scrub_thread, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+/**
+ *
+ */
+static int
+scrub_start(const char *user,
+            int argc, const char **argv, int *intv,
+            void (*msg)(void *opaque, const char *fmt, ...),
+            void *opaque)
+{
+  pthread_mutex_lock(&scrub_mutex);
+  if(scrub_stats.running) {
+    msg(opaque, "Scrub already in progress");
+  } else {
+    scrub_kick = 1;
+    pthread_cond_signal(&scrub_cond);
+    msg(opaque, "Scrub started");
+  }
+  pthread_mutex_unlock(&scrub_mutex);
+  return 0;
+}
+
+CMD(scrub_start,
+    CMD_LITERAL("scrub"),
+    CMD_LITERAL("start")
+    );
+
+
+/**
+ *
+ */
+static int
+scrub_status(const char *user,
+             int argc, const char **argv, int *intv,
+             void (*msg)(void *opaque, const char *fmt, ...),
+             void *opaque)
+{
+  pthread_mutex_lock(&scrub_mutex);
+
+  const time_t now = time(NULL);
+  const time_t end = scrub_stats.running ? now : scrub_stats.last_pass;
+  const int elapsed = end - scrub_stats.pass_started;
+
+  if(scrub_stats.passes == 0 && !scrub_stats.running) {
+    msg(opaque, "No scrub has run yet");
+  } else {
+    msg(opaque, "%s: shard %d/256, %u objects, %"PRId64" MB in %ds, "
+        "%.1f MB/s, %u corrupt",
+        scrub_stats.running ? "Running" : "Last pass",
+        scrub_stats.running ? scrub_stats.shard : 256,
+        scrub_stats.objects, scrub_stats.bytes / 1000000, elapsed,
+        elapsed ? scrub_stats.bytes / 1e6 / elapsed : 0.0,
+        scrub_stats.corrupt);
+  }
+  msg(opaque, "%u passes completed, %u objects quarantined since start",
+      scrub_stats.passes, scrub_stats.total_corrupt);
+
+  pthread_mutex_unlock(&scrub_mutex);
+  return 0;
+}
+
+CMD(scrub_status,
+    CMD_LITERAL("scrub"),
+    CMD_LITERAL("status")
+    );
@@ -0,0 +1,3 @@
+#pragma once
+
+void scrub_init(void);
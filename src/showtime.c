@@ -1,273 +1,1212 @@
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "libsvc/http.h"
-#include "libsvc/htsmsg_json.h"
 #include "libsvc/misc.h"
 #include "libsvc/trace.h"
 #include "libsvc/cfg.h"
-#include "libsvc/db.h"
+#include "libsvc/tcp.h"
 
 #include <openssl/sha.h>
+#include <zlib.h>
+#include <brotli/encode.h>
 
 #include "showtime.h"
-#include "sql_statements.h"
+#include "catalog.h"
+#include "arena.h"
+#include "jsonwriter.h"
 #include "spmc.h"
+#include "geoip.h"
 
 //	ua_re = regexp.MustCompile("^Showtime [^ ]+ ([0-9]+)\\.([0-9]+)\\.([0-9]+)"); 
 
-LIST_HEAD(plugin_list, plugin);
+/**
+ * Best version of each plugin visible to a client, in plugin id order
+ */
+typedef struct selection {
+  int num_plugins;
+  const catalog_version_t **plugins;
+} selection_t;
 
-typedef struct plugin {
-  LIST_ENTRY(plugin) link;
+/**
+ *
+ */
+static int
+check_password(http_connection_t *hc, const char *str)
+{
+  http_arg_t *ra;
 
-  uint32_t intver;
+  if(str == NULL || *str == 0)
+    return 0;
 
+  TAILQ_FOREACH(ra, &hc->hc_req_args, link)
+    if(!strcmp(ra->key, "betapassword") && !strcmp(ra->val, str))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Everything that affects the catalog as seen by a particular client
+ */
+typedef struct catalog_filter {
+  http_connection_t *hc;
+  uint32_t reqversion;
+  int bypass_access_control;
+  const char *arch;    // NULL if unknown, no filtering is done then
+  const char *region;  // Country code, likewise
+} catalog_filter_t;
+
+
+/**
+ * A response body with its pre-compressed variants. The compressed
+ * variants are NULL if compression did not make them smaller.
+ */
+typedef struct payload {
+  char *data;
+  size_t len;
+  char *gzdata;
+  size_t gzlen;
+  char *brdata;
+  size_t brlen;
+} payload_t;
+
+
+/**
+ * A plugin (or blacklisted version) as it appears in a rendered
+ * catalog. For plugins, offset and len locate its JSON in the body.
+ */
+typedef struct summary_entry {
   const char *id;
   const char *version;
-  const char *type;
-  const char *author;
-  const char *showtime_min_version;
-  const char *title;
-  const char *synopsis;
-  const char *description;
-  const char *homepage;
-  const char *category;
-  const char *downloadURL;
-  const char *icon;
+  uint32_t offset;
+  uint32_t len;
+} summary_entry_t;
+
+
+/**
+ * What a client holding a given ETag has, used for computing deltas.
+ * Both arrays are sorted.
+ */
+typedef struct summary {
+  TAILQ_ENTRY(summary) link;
+  int refcount;
+  char etag[41];
+  arena_t arena;
+  int num_plugins;
+  summary_entry_t *plugins;
+  int num_blacklist;
+  summary_entry_t *blacklist;
+} summary_t;
+
+TAILQ_HEAD(summary_queue, summary);
+
+
+/**
+ * Serialized catalog for one class of clients
+ */
+typedef struct response {
+  LIST_ENTRY(response) hash_link;
+  TAILQ_ENTRY(response) lru_link;
+  int refcount;
+  uint32_t hash;
+  uint32_t generation;
+  char *key;
+  payload_t json;
+  summary_t *summary;
+
+  // The binary encoding is only rendered once a client asks for it
+  pthread_mutex_t bin_mutex;
+  int bin_ready;
+  payload_t bin;
+} response_t;
+
+#define RESPONSE_HASH_SIZE 64
+
+LIST_HEAD(response_list, response);
+TAILQ_HEAD(response_queue, response);
+
+static pthread_mutex_t response_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct response_list response_hash[RESPONSE_HASH_SIZE];
+static struct response_queue response_lru =
+  TAILQ_HEAD_INITIALIZER(response_lru);
+static int response_count;
+
+// Summaries of recently rendered catalogs, newest first
+static struct summary_queue summary_history =
+  TAILQ_HEAD_INITIALIZER(summary_history);
+static int summary_history_len;
+
+
+/**
+ *
+ */
+static char *
+gzip_compress(const char *src, size_t srclen, size_t *outlen)
+{
+  z_stream z = {0};
+
+  if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                  Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t bufsize = deflateBound(&z, srclen);
+  char *buf = malloc(bufsize);
+
+  z.next_in   = (void *)src;
+  z.avail_in  = srclen;
+  z.next_out  = (void *)buf;
+  z.avail_out = bufsize;
+
+  if(deflate(&z, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&z);
+    free(buf);
+    return NULL;
+  }
+  *outlen = z.total_out;
+  deflateEnd(&z);
+  return buf;
+}
+
+
+/**
+ *
+ */
+static char *
+brotli_compress(const char *src, size_t srclen, size_t *outlen)
+{
+  cfg_root(root);
+  const int quality =
+    cfg_get_int(root, CFG("catalog", "brotliquality"), 9);
 
-} plugin_t;
+  size_t bufsize = BrotliEncoderMaxCompressedSize(srclen);
+  if(bufsize == 0)
+    return NULL;
 
-#define SETVAL(field) do {                              \
-    if(p->field == NULL || strcmp(p->field, field)) {   \
-      p->field = mystrdupa(field);                      \
-    }                                                   \
-  } while(0)
+  char *buf = malloc(bufsize);
+  if(!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
+                            BROTLI_MODE_TEXT, srclen, (const uint8_t *)src,
+                            &bufsize, (uint8_t *)buf)) {
+    free(buf);
+    return NULL;
+  }
+  *outlen = bufsize;
+  return buf;
+}
+
+
+/**
+ * Takes ownership of data
+ */
+static void
+payload_init(payload_t *pl, char *data, size_t len)
+{
+  pl->data = data;
+  pl->len = len;
+
+  pl->gzdata = gzip_compress(data, len, &pl->gzlen);
+  if(pl->gzdata != NULL && pl->gzlen >= len) {
+    free(pl->gzdata);
+    pl->gzdata = NULL;
+  }
+
+  pl->brdata = brotli_compress(data, len, &pl->brlen);
+  if(pl->brdata != NULL && pl->brlen >= len) {
+    free(pl->brdata);
+    pl->brdata = NULL;
+  }
+}
 
 
 /**
  *
  */
+static void
+payload_free(payload_t *pl)
+{
+  free(pl->data);
+  free(pl->gzdata);
+  free(pl->brdata);
+}
+
+
+/**
+ * Check if the client accepts the given content-coding, ie. it is
+ * listed in Accept-Encoding without a zero q-value
+ */
 static int
-check_password(http_connection_t *hc, const char *str)
+accepts_encoding(const char *ae, const char *coding)
 {
-  http_arg_t *ra;
+  const size_t codinglen = strlen(coding);
 
-  if(str == NULL || *str == 0)
-    return 0;
+  while(ae != NULL && *ae) {
+    while(*ae == ' ' || *ae == ',')
+      ae++;
 
-  TAILQ_FOREACH(ra, &hc->hc_req_args, link)
-    if(!strcmp(ra->key, "betapassword") && !strcmp(ra->val, str))
+    const char *end = strchr(ae, ',');
+    size_t toklen = strcspn(ae, " ;,");
+
+    if(toklen == codinglen && !strncasecmp(ae, coding, codinglen)) {
+      const char *q = strstr(ae, ";q=");
+      if(q != NULL && (end == NULL || q < end) && strtod(q + 3, NULL) == 0)
+        return 0;
       return 1;
+    }
+    ae = end;
+  }
   return 0;
 }
 
 
 /**
- *
+ * Each content-coding is a representation of its own and needs a
+ * strong ETag of its own. The coding is appended to the entity tag
+ */
+static void
+payload_etag(char *out, size_t outsize, const char *etag, const char *ce)
+{
+  if(ce == NULL)
+    snprintf(out, outsize, "%s", etag);
+  else
+    snprintf(out, outsize, "%s-%s", etag, !strcmp(ce, "gzip") ? "gz" : ce);
+}
+
+
+/**
+ * Check if 'tag' from a client is the ETag of any representation of
+ * the document with 'etag'
  */
 static int
-plugins_v1_json(http_connection_t *hc, const char *remain,
-                void *opaque)
+etag_matches(const char *tag, const char *etag)
+{
+  const size_t len = strlen(etag);
+
+  if(tag == NULL || strncmp(tag, etag, len))
+    return 0;
+  return tag[len] == 0 || !strcmp(tag + len, "-gz") ||
+    !strcmp(tag + len, "-br");
+}
+
+
+/**
+ * Send a payload, picking the smallest variant the client accepts
+ */
+static int
+payload_send(http_connection_t *hc, const payload_t *pl,
+             const char *content_type, const char *etag)
 {
+  const char *ae = http_arg_get(&hc->hc_args, "accept-encoding");
+  const char *ce = NULL;
+  const char *data = pl->data;
+  size_t len = pl->len;
+  char petag[64];
+
+  if(pl->brdata != NULL && accepts_encoding(ae, "br")) {
+    ce = "br";
+    data = pl->brdata;
+    len = pl->brlen;
+  } else if(pl->gzdata != NULL && accepts_encoding(ae, "gzip")) {
+    ce = "gzip";
+    data = pl->gzdata;
+    len = pl->gzlen;
+  }
+
+  payload_etag(petag, sizeof(petag), etag, ce);
+  http_arg_set(&hc->hc_response_headers, "ETag", petag);
+
+  if(ce == NULL) {
+    htsbuf_append(&hc->hc_reply, data, len);
+    return http_output_content(hc, content_type);
+  }
+
+  http_send_header(hc, HTTP_STATUS_OK, content_type, len, ce,
+                   NULL, 0, NULL, NULL, NULL);
+
+  if(hc->hc_no_output)
+    return 0;
+  return tcp_write(hc->hc_ts, data, len) ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+static void
+summary_release(summary_t *s)
+{
+  if(__sync_sub_and_fetch(&s->refcount, 1))
+    return;
+  arena_destroy(&s->arena);
+  free(s);
+}
+
+
+/**
+ * Remember a summary so clients holding its ETag can ask for a delta.
+ * History is bounded by catalog.deltahistory entries. A response that
+ * was evicted and rendered again has a summary remembered already,
+ * which is just moved to the front
+ */
+static void
+summary_remember(summary_t *s)
+{
+  summary_t *old;
   cfg_root(root);
+  const int maxlen = cfg_get_int(root, CFG("catalog", "deltahistory"), 64);
 
-  const char *baseurl = cfg_get_str(root, CFG("baseurl"), NULL);
+  pthread_mutex_lock(&response_mutex);
 
-  if(baseurl == NULL)
-    return 400;
+  TAILQ_FOREACH(old, &summary_history, link)
+    if(!strcmp(old->etag, s->etag))
+      break;
 
-  const char *ua = http_arg_get(&hc->hc_args, "user-agent");
+  if(old != NULL) {
+    TAILQ_REMOVE(&summary_history, old, link);
+    TAILQ_INSERT_HEAD(&summary_history, old, link);
+    pthread_mutex_unlock(&response_mutex);
+    return;
+  }
 
-  int bypass_access_control =
-    check_password(hc, cfg_get_str(root, CFG("admin", "betapassword"), NULL));
+  __sync_add_and_fetch(&s->refcount, 1);
+  TAILQ_INSERT_HEAD(&summary_history, s, link);
+  summary_history_len++;
 
-  int reqversion = INT32_MAX;
-  //  const char *arch = NULL;
+  while(summary_history_len > maxlen) {
+    old = TAILQ_LAST(&summary_history, summary_queue);
+    TAILQ_REMOVE(&summary_history, old, link);
+    summary_history_len--;
+    summary_release(old);
+  }
+  pthread_mutex_unlock(&response_mutex);
+}
 
-  if(ua != NULL) {
-    const char *x = mystrbegins(ua, "Showtime ");
-    if(x != NULL) {
-      char *y = mystrdupa(x);
-      //      arch = y;
-      y = strchr(y, ' ');
-      if(y != NULL) {
-        *y++ = 0;
-        reqversion = parse_version_int(y);
-      }
-    }
+
+/**
+ *
+ */
+static summary_t *
+summary_find(const char *etag)
+{
+  summary_t *s;
+
+  pthread_mutex_lock(&response_mutex);
+  TAILQ_FOREACH(s, &summary_history, link)
+    if(!strcmp(s->etag, etag))
+      break;
+  if(s != NULL)
+    __sync_add_and_fetch(&s->refcount, 1);
+  pthread_mutex_unlock(&response_mutex);
+  return s;
+}
+
+
+/**
+ *
+ */
+static int
+summary_entry_cmp(const void *A, const void *B)
+{
+  const summary_entry_t *a = A;
+  const summary_entry_t *b = B;
+  int r = strcmp(a->id, b->id);
+  return r ?: strcmp(a->version, b->version);
+}
+
+
+/**
+ *
+ */
+static void
+response_release(response_t *r)
+{
+  if(__sync_sub_and_fetch(&r->refcount, 1))
+    return;
+  free(r->key);
+  payload_free(&r->json);
+  payload_free(&r->bin);
+  pthread_mutex_destroy(&r->bin_mutex);
+  if(r->summary != NULL)
+    summary_release(r->summary);
+  free(r);
+}
+
+
+/**
+ *
+ */
+static response_t *
+response_find(const char *key, uint32_t hash, uint32_t generation)
+{
+  response_t *r;
+
+  pthread_mutex_lock(&response_mutex);
+  LIST_FOREACH(r, &response_hash[hash % RESPONSE_HASH_SIZE], hash_link)
+    if(r->hash == hash && !strcmp(r->key, key))
+      break;
+
+  if(r != NULL && r->generation == generation) {
+    TAILQ_REMOVE(&response_lru, r, lru_link);
+    TAILQ_INSERT_HEAD(&response_lru, r, lru_link);
+    __sync_add_and_fetch(&r->refcount, 1);
+  } else {
+    r = NULL;
   }
+  pthread_mutex_unlock(&response_mutex);
+  return r;
+}
 
-  db_conn_t *c = db_get_conn();
-  if(c == NULL)
-    return 500;
 
-  db_stmt_t *s = db_stmt_get(c, SQL_GET_ALL);
+/**
+ *
+ */
+static void
+response_unlink(response_t *r)
+{
+  LIST_REMOVE(r, hash_link);
+  TAILQ_REMOVE(&response_lru, r, lru_link);
+  response_count--;
+  response_release(r);
+}
 
-  if(db_stmt_exec(s, ""))
-    return 500;
 
-  struct plugin_list plugins;
-  LIST_INIT(&plugins);
-
-  htsmsg_t *blacklist = htsmsg_create_list();
-
-  while(1) {
-
-    time_t created;
-    char id[128];
-    char version[64];
-    char type[64];
-    char author[128];
-    char showtime_min_version[64];
-    int downloads;
-    char title[256];
-    char category[64];
-    char synopsis[256];
-    char description[4096];
-    char homepage[256];
-    char pkg_digest[64];
-    char icon_digest[64];
-    int published;
-    char comment[4096];
-    char status[8];
-    char betasecret[64];
-
-    int r = db_stream_row(0, s,
-                          DB_RESULT_STRING(id),
-                          DB_RESULT_TIME(created),
-                          DB_RESULT_STRING(version),
-                          DB_RESULT_STRING(type),
-                          DB_RESULT_STRING(author),
-                          DB_RESULT_INT(downloads),
-                          DB_RESULT_STRING(showtime_min_version),
-                          DB_RESULT_STRING(title),
-                          DB_RESULT_STRING(category),
-                          DB_RESULT_STRING(synopsis),
-                          DB_RESULT_STRING(description),
-                          DB_RESULT_STRING(homepage),
-                          DB_RESULT_STRING(pkg_digest),
-                          DB_RESULT_STRING(icon_digest),
-                          DB_RESULT_INT(published),
-                          DB_RESULT_STRING(comment),
-                          DB_RESULT_STRING(status),
-                          DB_RESULT_STRING(betasecret)
-                          );
-    if(r)
+/**
+ * Insert a freshly rendered response, replacing any stale entry
+ * with the same key
+ */
+static void
+response_insert(response_t *n)
+{
+  response_t *r;
+  cfg_root(root);
+  const int maxentries = cfg_get_int(root, CFG("catalog", "cachesize"), 64);
+
+  pthread_mutex_lock(&response_mutex);
+
+  LIST_FOREACH(r, &response_hash[n->hash % RESPONSE_HASH_SIZE], hash_link)
+    if(r->hash == n->hash && !strcmp(r->key, n->key))
       break;
 
-    int beta = check_password(hc, betasecret);
+  if(r != NULL)
+    response_unlink(r);
 
-    if(*status == 'r') {
-      // Rejected pluginversion, add to blacklist
-      htsmsg_t *m = htsmsg_create_map();
-      htsmsg_add_str(m, "id", id);
-      htsmsg_add_str(m, "version", version);
-      htsmsg_add_msg(blacklist, NULL, m);
-      continue;
+  n->refcount++;
+  LIST_INSERT_HEAD(&response_hash[n->hash % RESPONSE_HASH_SIZE], n,
+                   hash_link);
+  TAILQ_INSERT_HEAD(&response_lru, n, lru_link);
+  response_count++;
+
+  while(response_count > maxentries &&
+        (r = TAILQ_LAST(&response_lru, response_queue)) != n)
+    response_unlink(r);
+
+  pthread_mutex_unlock(&response_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+has_betapassword(http_connection_t *hc)
+{
+  http_arg_t *ra;
+  TAILQ_FOREACH(ra, &hc->hc_req_args, link)
+    if(!strcmp(ra->key, "betapassword"))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Derive the response cache key. Plugins unlocked by betasecrets are
+ * folded into a hash to keep the key short.
+ */
+static void
+catalog_filter_key(char *key, size_t keysize, const catalog_t *cat,
+                   const catalog_filter_t *cf, const char *baseurl)
+{
+  char betahash[41] = "";
+
+  if(has_betapassword(cf->hc)) {
+    SHA_CTX ctx;
+    uint8_t md[20];
+    int matched = 0;
+
+    SHA1_Init(&ctx);
+    for(int i = 0; i < cat->num_plugins; i++) {
+      const catalog_plugin_t *cp = &cat->plugins[i];
+      if(!check_password(cf->hc, cp->betasecret))
+        continue;
+      SHA1_Update(&ctx, cp->id, strlen(cp->id) + 1);
+      matched = 1;
     }
+    SHA1_Final(md, &ctx);
+    if(matched)
+      bin2hex(betahash, sizeof(betahash), md, 20);
+  }
+
+  // Clients on an architecture no plugin is restricted to only see
+  // unrestricted plugins, clients not telling us see everything
+  const char *arch = catalog_arch_bucket(cat, cf->arch);
+  if(arch == NULL && cf->arch != NULL)
+    arch = "?";
+
+  // Same for regions, so there is one snapshot per region that matters
+  const char *region = catalog_region_bucket(cat, cf->region);
+  if(region == NULL && cf->region != NULL)
+    region = "?";
+
+  snprintf(key, keysize, "%d:%d:%s:%s:%s:%s",
+           catalog_version_bucket(cat, cf->reqversion),
+           cf->bypass_access_control, arch ?: "", region ?: "",
+           betahash, baseurl);
+}
+
+
+/**
+ * The ETag only depends on catalog content and the client class, so it
+ * can be checked without rendering anything. Since it is derived from
+ * the snapshot fingerprint it is stable across restarts.
+ */
+static void
+catalog_etag(char etag[41], const catalog_t *cat, const char *key,
+             const char *format)
+{
+  SHA_CTX ctx;
+  uint8_t md[20];
+
+  SHA1_Init(&ctx);
+  SHA1_Update(&ctx, cat->fingerprint, sizeof(cat->fingerprint));
+  SHA1_Update(&ctx, key, strlen(key));
+  SHA1_Update(&ctx, format, strlen(format));
+  SHA1_Final(md, &ctx);
+  bin2hex(etag, 41, md, 20);
+}
 
-    if(!bypass_access_control) {
 
-      if(*status != 'a' && (!beta || downloads >= 5000))
+/**
+ * Pick the best version of each plugin visible to the client
+ * described by 'cf'. Versions of a plugin are ordered highest first
+ * in the snapshot so we can stop at the first visible one. Rows with
+ * equal versions are oldest first, so the oldest of them wins as it did
+ * when the catalog was built per request. Plugins come out in id order
+ */
+static void
+catalog_select(const catalog_t *cat, const catalog_filter_t *cf,
+               selection_t *sel)
+{
+  sel->plugins = malloc((cat->num_plugins + 1) *
+                        sizeof(const catalog_version_t *));
+  sel->num_plugins = 0;
+
+  for(int i = 0; i < cat->num_plugins; i++) {
+    const catalog_plugin_t *cp = &cat->plugins[i];
+    const int beta = !cf->bypass_access_control &&
+      check_password(cf->hc, cp->betasecret);
+
+    for(int j = 0; j < cp->num_versions; j++) {
+      const catalog_version_t *cv = &cat->versions[cp->first_version + j];
+
+      if(cv->status == 'r')
+        continue; // Rejected pluginversion, goes to blacklist
+
+      if(!cf->bypass_access_control) {
+
+        if(cv->status != 'a' && (!beta || cv->popular))
+          continue;
+
+        if(!cv->published && !beta)
+          continue;
+      }
+
+      if(cv->intminver > cf->reqversion)
+        continue;
+
+      if(cf->arch != NULL && *cv->arch && !csv_contains(cv->arch, cf->arch))
         continue;
 
-      if(!published && !beta)
+      if(cf->region != NULL && *cv->regions &&
+         !csv_contains(cv->regions, cf->region))
         continue;
+
+      sel->plugins[sel->num_plugins++] = cv;
+      break;
     }
+  }
+}
 
-    int intver    = parse_version_int(version);
-    int intminver = parse_version_int(showtime_min_version);
 
-    if(intminver > reqversion)
-      continue;
+/**
+ *
+ */
+static char *
+queue_to_buf(htsbuf_queue_t *hq, size_t *lenp)
+{
+  size_t len = hq->hq_size;
+  char *out = malloc(len + 1);
+  htsbuf_read(hq, out, len);
+  htsbuf_queue_flush(hq);
+  out[len] = 0;
+  *lenp = len;
+  return out;
+}
 
-    plugin_t *p;
-    LIST_FOREACH(p, &plugins, link)
-      if(!strcmp(p->id, id))
-        break;
 
-    if(p != NULL && p->intver > intver)
-      continue;
+/**
+ * Render selected plugins as JSON. Returns a malloc'ed buffer and
+ * fills in 'sum' with what was rendered
+ */
+static char *
+catalog_render_json(const catalog_t *cat, const selection_t *sel,
+                    const char *baseurl, size_t *lenp, summary_t *sum)
+{
+  summary_entry_t *se;
+  htsbuf_queue_t hq;
+  jsonwriter_t jw;
+  char url[1024];
+
+  htsbuf_queue_init(&hq, 0);
+  jw_init(&jw, &hq);
+
+  jw_begin_map(&jw, NULL);
+  jw_u32(&jw, "version", 1);
+  jw_begin_list(&jw, "plugins");
+
+  sum->plugins = arena_alloc(&sum->arena,
+                             (sel->num_plugins + 1) * sizeof(summary_entry_t));
+  sum->num_plugins = 0;
+
+  for(int i = 0; i < sel->num_plugins; i++) {
+    const catalog_version_t *cv = sel->plugins[i];
+    jw_begin_map(&jw, NULL);
+
+    se = &sum->plugins[sum->num_plugins++];
+    se->id      = arena_strdup(&sum->arena, cv->id);
+    se->version = arena_strdup(&sum->arena, cv->version);
+    se->offset  = hq.hq_size - 1;
 
-    if(p == NULL) {
-      p = alloca(sizeof(plugin_t));
-      memset(p, 0, sizeof(plugin_t));
-      LIST_INSERT_HEAD(&plugins, p, link);
-      p->id = mystrdupa(id);
+    jw_str(&jw, "id",              cv->id);
+    jw_str(&jw, "version",         cv->version);
+    jw_str(&jw, "type",            cv->type);
+    jw_str(&jw, "author",          cv->author);
+    jw_str(&jw, "showtimeVersion", cv->showtime_min_version);
+    jw_str(&jw, "title",           cv->title);
+    jw_str(&jw, "synopsis",        cv->synopsis);
+    jw_str(&jw, "description",     cv->description);
+    jw_str(&jw, "homepage",        cv->homepage);
+    jw_str(&jw, "category",        cv->category);
+
+    snprintf(url, sizeof(url), "%s/data/%s", baseurl, cv->pkg_digest);
+    jw_str(&jw, "downloadURL",     url);
+
+    if(*cv->icon_digest) {
+      snprintf(url, sizeof(url), "%s/data/%s", baseurl, cv->icon_digest);
+      jw_str(&jw, "icon",          url);
     }
+    jw_end_map(&jw);
+    se->len = hq.hq_size - se->offset;
+  }
+
+  jw_end_list(&jw);
+  jw_begin_list(&jw, "blacklist");
+
+  sum->blacklist = arena_alloc(&sum->arena, (cat->num_rejected + 1) *
+                               sizeof(summary_entry_t));
+  sum->num_blacklist = 0;
+
+  for(int i = 0; i < cat->num_rejected; i++) {
+    const catalog_version_t *cv = cat->rejected[i];
+
+    se = &sum->blacklist[sum->num_blacklist++];
+    se->id      = arena_strdup(&sum->arena, cv->id);
+    se->version = arena_strdup(&sum->arena, cv->version);
+
+    jw_begin_map(&jw, NULL);
+    jw_str(&jw, "id", cv->id);
+    jw_str(&jw, "version", cv->version);
+    jw_end_map(&jw);
+  }
+
+  jw_end_list(&jw);
+  jw_end_map(&jw);
+
+  char *out = queue_to_buf(&hq, lenp);
+
+  qsort(sum->plugins, sum->num_plugins, sizeof(summary_entry_t),
+        summary_entry_cmp);
+  qsort(sum->blacklist, sum->num_blacklist, sizeof(summary_entry_t),
+        summary_entry_cmp);
+  return out;
+}
+
+
+/**
+ * String table for the binary catalog format
+ */
+typedef struct strtab_entry {
+  struct strtab_entry *next;
+  const char *str;
+  uint32_t hash;
+  uint32_t index;
+} strtab_entry_t;
+
+typedef struct strtab {
+  arena_t *arena;
+  strtab_entry_t **hash;
+  unsigned int mask;
+  const char **strings;
+  uint32_t count;
+} strtab_t;
+
+
+/**
+ *
+ */
+static void
+strtab_init(strtab_t *st, arena_t *arena, int maxstrings)
+{
+  unsigned int size = 16;
+  while(size < maxstrings * 2)
+    size <<= 1;
+
+  st->arena = arena;
+  st->hash = arena_zalloc(arena, size * sizeof(strtab_entry_t *));
+  st->mask = size - 1;
+  st->strings = arena_alloc(arena, maxstrings * sizeof(const char *));
+  st->count = 0;
+}
+
+
+/**
+ * Returns index + 1, so 0 can be used to encode an absent string
+ */
+static uint32_t
+strtab_ref(strtab_t *st, const char *str)
+{
+  const uint32_t hash = strhash(str);
+  strtab_entry_t *e;
+
+  for(e = st->hash[hash & st->mask]; e != NULL; e = e->next)
+    if(e->hash == hash && !strcmp(e->str, str))
+      return e->index + 1;
+
+  e = arena_alloc(st->arena, sizeof(strtab_entry_t));
+  e->str = str;
+  e->hash = hash;
+  e->index = st->count;
+  e->next = st->hash[hash & st->mask];
+  st->hash[hash & st->mask] = e;
+  st->strings[st->count++] = str;
+  return e->index + 1;
+}
+
+
+/**
+ * Unsigned LEB128
+ */
+static void
+put_varint(htsbuf_queue_t *hq, uint32_t v)
+{
+  uint8_t buf[5];
+  int n = 0;
+  do {
+    buf[n] = v & 0x7f;
+    v >>= 7;
+    if(v)
+      buf[n] |= 0x80;
+    n++;
+  } while(v);
+  htsbuf_append(hq, buf, n);
+}
+
+
+#define CATALOG_BIN_CONTENT_TYPE  "application/x-spmc-catalog"
+#define CATALOG_BIN_MAGIC         "SPMB"
+#define CATALOG_BIN_VERSION       1
+#define CATALOG_BIN_PLUGIN_FIELDS 12
+
+/**
+ * Render selected plugins in the compact binary format. All integers
+ * are unsigned LEB128 varints and strings are referred to by
+ * (index + 1) into the string table, 0 meaning absent:
+ *
+ *   "SPMB" version
+ *   nstrings { length bytes }...
+ *   urlprefix                          ref, prepended to digests
+ *   nplugins { nfields ref... }...     id version type author
+ *                                      showtimeVersion title synopsis
+ *                                      description homepage category
+ *                                      package-digest icon-digest
+ *   nblacklist { nfields ref... }...   id version
+ *
+ * Records carry their field count so fields can be appended later.
+ */
+static char *
+catalog_render_bin(const catalog_t *cat, const selection_t *sel,
+                   const char *baseurl, size_t *lenp)
+{
+  char urlprefix[1024];
+  arena_t arena;
+  strtab_t st;
+  htsbuf_queue_t hq;
+
+  const int maxstrings =
+    1 + sel->num_plugins * CATALOG_BIN_PLUGIN_FIELDS + cat->num_rejected * 2;
+  const int numrefs = sel->num_plugins * CATALOG_BIN_PLUGIN_FIELDS;
+
+  arena_init(&arena, maxstrings * (sizeof(strtab_entry_t) + 16) +
+             numrefs * sizeof(uint32_t));
+  strtab_init(&st, &arena, maxstrings);
+
+  snprintf(urlprefix, sizeof(urlprefix), "%s/data/", baseurl);
+  const uint32_t urlref = strtab_ref(&st, urlprefix);
+
+  // Intern everything first so the string table can be written upfront
+  uint32_t *refs = arena_alloc(&arena, (numrefs + 1) * sizeof(uint32_t));
+  uint32_t *r = refs;
+
+  for(int i = 0; i < sel->num_plugins; i++) {
+    const catalog_version_t *cv = sel->plugins[i];
+    *r++ = strtab_ref(&st, cv->id);
+    *r++ = strtab_ref(&st, cv->version);
+    *r++ = strtab_ref(&st, cv->type);
+    *r++ = strtab_ref(&st, cv->author);
+    *r++ = strtab_ref(&st, cv->showtime_min_version);
+    *r++ = strtab_ref(&st, cv->title);
+    *r++ = strtab_ref(&st, cv->synopsis);
+    *r++ = strtab_ref(&st, cv->description);
+    *r++ = strtab_ref(&st, cv->homepage);
+    *r++ = strtab_ref(&st, cv->category);
+    *r++ = strtab_ref(&st, cv->pkg_digest);
+    *r++ = *cv->icon_digest ? strtab_ref(&st, cv->icon_digest) : 0;
+  }
+
+  for(int i = 0; i < cat->num_rejected; i++) {
+    const catalog_version_t *cv = cat->rejected[i];
+    strtab_ref(&st, cv->id);
+    strtab_ref(&st, cv->version);
+  }
+
+  htsbuf_queue_init(&hq, 0);
+  htsbuf_append(&hq, CATALOG_BIN_MAGIC, 4);
+  put_varint(&hq, CATALOG_BIN_VERSION);
+
+  put_varint(&hq, st.count);
+  for(uint32_t i = 0; i < st.count; i++) {
+    const size_t len = strlen(st.strings[i]);
+    put_varint(&hq, len);
+    htsbuf_append(&hq, st.strings[i], len);
+  }
 
-    p->intver   = intver;
-    p->version  = mystrdupa(version);
-    SETVAL(type);
-    SETVAL(author);
-    SETVAL(showtime_min_version);
-    SETVAL(title);
-    SETVAL(synopsis);
-    SETVAL(description);
-    SETVAL(homepage);
-    SETVAL(category);
-
-    char url[1024];
-
-    snprintf(url, sizeof(url), "%s/data/%s", baseurl, pkg_digest);
-    p->downloadURL = mystrdupa(url);
-
-    if(*icon_digest) {
-      snprintf(url, sizeof(url), "%s/data/%s", baseurl, icon_digest);
-      p->icon = mystrdupa(url);
-    } else {
-      p->icon = NULL;
+  put_varint(&hq, urlref);
+
+  put_varint(&hq, sel->num_plugins);
+  for(int i = 0; i < sel->num_plugins; i++) {
+    put_varint(&hq, CATALOG_BIN_PLUGIN_FIELDS);
+    for(int j = 0; j < CATALOG_BIN_PLUGIN_FIELDS; j++)
+      put_varint(&hq, refs[i * CATALOG_BIN_PLUGIN_FIELDS + j]);
+  }
+
+  put_varint(&hq, cat->num_rejected);
+  for(int i = 0; i < cat->num_rejected; i++) {
+    const catalog_version_t *cv = cat->rejected[i];
+    put_varint(&hq, 2);
+    put_varint(&hq, strtab_ref(&st, cv->id));
+    put_varint(&hq, strtab_ref(&st, cv->version));
+  }
+
+  arena_destroy(&arena);
+  return queue_to_buf(&hq, lenp);
+}
+
+
+#define DELTA_CHANGED       0  // New ids or new versions, as full entries
+#define DELTA_REMOVED_IDS   1  // Ids no longer present
+#define DELTA_REMOVED_PAIRS 2  // id/version pairs no longer present
+
+/**
+ * Merge two sorted summaries and emit entries of 'a' that are not
+ * in 'b' according to 'mode'
+ */
+static void
+delta_emit(jsonwriter_t *jw, const summary_entry_t *a, int na,
+           const summary_entry_t *b, int nb, int mode, const char *body)
+{
+  int i = 0, j = 0;
+
+  while(i < na) {
+    int r = j < nb ? strcmp(a[i].id, b[j].id) : -1;
+
+    if(r == 0 && mode == DELTA_REMOVED_PAIRS)
+      r = strcmp(a[i].version, b[j].version);
+
+    if(r > 0) {
+      j++;
+      continue;
     }
+
+    const int emit = r < 0 ||
+      (mode == DELTA_CHANGED && strcmp(a[i].version, b[j].version));
+
+    if(emit) {
+      switch(mode) {
+      case DELTA_CHANGED:
+        jw_raw(jw, NULL, body + a[i].offset, a[i].len);
+        break;
+      case DELTA_REMOVED_IDS:
+        jw_str(jw, NULL, a[i].id);
+        break;
+      case DELTA_REMOVED_PAIRS:
+        jw_begin_map(jw, NULL);
+        jw_str(jw, "id", a[i].id);
+        jw_str(jw, "version", a[i].version);
+        jw_end_map(jw);
+        break;
+      }
+    }
+
+    if(r == 0)
+      j++;
+    i++;
   }
+}
+
+
+/**
+ * Send only what changed between the catalog described by 'old' and
+ * the current response 'r'
+ */
+static int
+catalog_delta_send(http_connection_t *hc, const response_t *r,
+                   const summary_t *old)
+{
+  const summary_t *cur = r->summary;
+  jsonwriter_t jw;
+
+  jw_init(&jw, &hc->hc_reply);
+  jw_begin_map(&jw, NULL);
+  jw_u32(&jw, "version", 1);
+  jw_str(&jw, "since", old->etag);
+  jw_str(&jw, "etag", cur->etag);  // What the client has once applied
+
+  // Added plugins and plugins with a new version
+  jw_begin_list(&jw, "plugins");
+  delta_emit(&jw, cur->plugins, cur->num_plugins,
+             old->plugins, old->num_plugins, DELTA_CHANGED, r->json.data);
+  jw_end_list(&jw);
+
+  jw_begin_list(&jw, "removed");
+  delta_emit(&jw, old->plugins, old->num_plugins,
+             cur->plugins, cur->num_plugins, DELTA_REMOVED_IDS, NULL);
+  jw_end_list(&jw);
+
+  jw_begin_list(&jw, "blacklist");
+  delta_emit(&jw, cur->blacklist, cur->num_blacklist,
+             old->blacklist, old->num_blacklist, DELTA_REMOVED_PAIRS, NULL);
+  jw_end_list(&jw);
+
+  jw_begin_list(&jw, "unblacklist");
+  delta_emit(&jw, old->blacklist, old->num_blacklist,
+             cur->blacklist, cur->num_blacklist, DELTA_REMOVED_PAIRS, NULL);
+  jw_end_list(&jw);
+
+  jw_end_map(&jw);
+  return http_output_content(hc, "application/json");
+}
+
+
+/**
+ * Check if the client asked for the binary catalog format, either with
+ * format=bin or via the Accept header
+ */
+static int
+wants_binary(http_connection_t *hc)
+{
+  const char *format = http_arg_get(&hc->hc_req_args, "format");
+  if(format != NULL)
+    return !strcmp(format, "bin");
+
+  const char *accept = http_arg_get(&hc->hc_args, "accept");
+  return accept != NULL && strstr(accept, CATALOG_BIN_CONTENT_TYPE) != NULL;
+}
+
+
+/**
+ *
+ */
+static response_t *
+response_create(const catalog_t *cat, const catalog_filter_t *cf,
+                const char *baseurl, const char *key, uint32_t hash,
+                const char *json_etag)
+{
+  selection_t sel;
+  size_t len;
+  char *buf;
+
+  response_t *r = calloc(1, sizeof(response_t));
+  r->refcount = 1;
+  r->hash = hash;
+  r->generation = cat->generation;
+  r->key = strdup(key);
+  pthread_mutex_init(&r->bin_mutex, NULL);
 
-  plugin_t *p;
-
-  htsmsg_t *pm = htsmsg_create_list();
-  LIST_FOREACH(p, &plugins, link) {
-    htsmsg_t *m = htsmsg_create_map();
-    htsmsg_add_str(m, "id",              p->id);
-    htsmsg_add_str(m, "version",         p->version);
-    htsmsg_add_str(m, "type",            p->type);
-    htsmsg_add_str(m, "author",          p->author);
-    htsmsg_add_str(m, "showtimeVersion", p->showtime_min_version);
-    htsmsg_add_str(m, "title",           p->title);
-    htsmsg_add_str(m, "synopsis",        p->synopsis);
-    htsmsg_add_str(m, "description",     p->description);
-    htsmsg_add_str(m, "homepage",        p->homepage);
-    htsmsg_add_str(m, "category",        p->category);
-    htsmsg_add_str(m, "downloadURL",     p->downloadURL);
-    if(p->icon)
-      htsmsg_add_str(m, "icon",          p->icon);
-    htsmsg_add_msg(pm, NULL, m);
+  r->summary = calloc(1, sizeof(summary_t));
+  r->summary->refcount = 1;
+  snprintf(r->summary->etag, sizeof(r->summary->etag), "%s", json_etag);
+  arena_init(&r->summary->arena, 0);
+
+  catalog_select(cat, cf, &sel);
+
+  buf = catalog_render_json(cat, &sel, baseurl, &len, r->summary);
+  payload_init(&r->json, buf, len);
+
+  free(sel.plugins);
+  return r;
+}
+
+
+/**
+ * Render the binary encoding of a response on first use. 'cat' must
+ * be the snapshot the response was created from
+ */
+static const payload_t *
+response_get_bin(response_t *r, const catalog_t *cat,
+                 const catalog_filter_t *cf, const char *baseurl)
+{
+  selection_t sel;
+  size_t len;
+
+  pthread_mutex_lock(&r->bin_mutex);
+  if(!r->bin_ready) {
+    catalog_select(cat, cf, &sel);
+    char *buf = catalog_render_bin(cat, &sel, baseurl, &len);
+    payload_init(&r->bin, buf, len);
+    free(sel.plugins);
+    r->bin_ready = 1;
   }
+  pthread_mutex_unlock(&r->bin_mutex);
+  return &r->bin;
+}
+
+
+/**
+ * Device catalog. Clients may pass the ETag of the catalog they have
+ * as 'since' to only receive added/changed plugins plus the ids that
+ * were removed. If that catalog is no longer remembered the full
+ * document is sent. A delta carries the ETag of the resulting catalog
+ * in its body, not as a header.
+ *
+ * The same catalog is available in a compact binary encoding, see
+ * catalog_render_bin(). Deltas are only available as JSON.
+ */
+static int
+plugins_v1_json(http_connection_t *hc, const char *remain,
+                void *opaque)
+{
+  catalog_filter_t cf;
+  char key[1024];
+  char cc[3];
+  char json_etag[41];
+  char bin_etag[41];
+  cfg_root(root);
 
-  htsmsg_t *m = htsmsg_create_map();
+  const char *baseurl = cfg_get_str(root, CFG("baseurl"), NULL);
 
-  htsmsg_add_u32(m, "version", 1);
-  htsmsg_add_msg(m, "plugins", pm);
-  htsmsg_add_msg(m, "blacklist", blacklist);
+  if(baseurl == NULL)
+    return 400;
 
-  char *json = htsmsg_json_serialize_to_str(m, 1);
-  htsmsg_destroy(m);
+  const char *ua = http_arg_get(&hc->hc_args, "user-agent");
 
-  uint8_t md[20];
-  char digest[41];
-  SHA1((void *)json, strlen(json), md);
-  bin2hex(digest, 41, md, 20);
+  cf.hc = hc;
+  cf.bypass_access_control =
+    check_password(hc, cfg_get_str(root, CFG("admin", "betapassword"), NULL));
+
+  cf.reqversion = UINT32_MAX;
+  cf.arch = NULL;
+  cf.region = geoip_lookup(hc->hc_peer, cc) ? NULL : cc;
+
+  if(ua != NULL) {
+    const char *x = mystrbegins(ua, "Showtime ");
+    if(x != NULL) {
+      // "Showtime <arch> <version>", or just "Showtime <version>"
+      char *y = mystrdupa(x);
+      char *z = strchr(y, ' ');
+      if(z != NULL) {
+        *z++ = 0;
+        cf.arch = y;
+        cf.reqversion = parse_version_int(z);
+      } else {
+        cf.reqversion = parse_version_int(y);
+      }
+    }
+  }
+
+  catalog_t *cat = catalog_get();
+  if(cat == NULL)
+    return 500;
+
+  const int binary = wants_binary(hc);
 
-  http_arg_set(&hc->hc_response_headers, "ETag", digest);
+  catalog_filter_key(key, sizeof(key), cat, &cf, baseurl);
+  catalog_etag(json_etag, cat, key, "json");
+  catalog_etag(bin_etag, cat, key, "bin");
+
+  const char *etag = binary ? bin_etag : json_etag;
+
+  http_arg_set(&hc->hc_response_headers, "Vary", "Accept, Accept-Encoding");
 
   const char *cached_copy = http_arg_get(&hc->hc_args, "If-None-Match");
-  if(cached_copy && !strcmp(cached_copy, digest)) {
-    free(json);
+  const char *since = http_arg_get(&hc->hc_req_args, "since");
+
+  if(etag_matches(cached_copy, etag) || etag_matches(since, etag)) {
+    http_arg_set(&hc->hc_response_headers, "ETag",
+                 etag_matches(cached_copy, etag) ? cached_copy : since);
+    catalog_release(cat);
     return 304;
   }
 
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
-  http_output_content(hc, "application/json");
-  return 0;
+  // The client may hold a compressed representation, deltas are
+  // computed against the catalog itself
+  char since_etag[41];
+  if(since != NULL && strlen(since) == 43 &&
+     (!strcmp(since + 40, "-gz") || !strcmp(since + 40, "-br"))) {
+    snprintf(since_etag, sizeof(since_etag), "%.40s", since);
+    since = since_etag;
+  }
+
+  const uint32_t hash = strhash(key);
+  response_t *r = response_find(key, hash, cat->generation);
+
+  if(r == NULL) {
+    r = response_create(cat, &cf, baseurl, key, hash, json_etag);
+    summary_remember(r->summary);
+    response_insert(r);
+  }
+
+  // Same generation as 'cat', so it renders the same selection
+  const payload_t *bin =
+    binary ? response_get_bin(r, cat, &cf, baseurl) : NULL;
+
+  catalog_release(cat);
+
+  // Clients that still hold a catalog we remember only get the changes
+  summary_t *old = since != NULL && !binary ? summary_find(since) : NULL;
+
+  int rval;
+  if(binary) {
+    rval = payload_send(hc, bin, CATALOG_BIN_CONTENT_TYPE, etag);
+  } else if(old != NULL) {
+    // No ETag, a delta is not the document a later If-None-Match or
+    // 'since' would refer to
+    rval = catalog_delta_send(hc, r, old);
+    summary_release(old);
+  } else {
+    rval = payload_send(hc, &r->json, "application/json", etag);
+  }
+  response_release(r);
+  return rval;
 }
 
 
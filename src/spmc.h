@@ -6,3 +6,9 @@
 #define SPMC_USER_AUTOAPPROVE     0x2
 
 uint32_t parse_version_int(const char *str);
+
+uint32_t strhash(const char *str);
+
+int csv_contains(const char *list, const char *token);
+
+int digest_parse(uint8_t out[20], const char *str);
@@ -4,8 +4,12 @@
 
 #define SQL_GET_PLUGIN_VERSIONS "SELECT created,version,type,author,downloads,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,published,comment,status FROM version WHERE plugin_id=?"
 
-#define SQL_GET_ALL "SELECT plugin_id,v.created,version,type,author,downloads,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,published,comment,status,plugin.betasecret FROM version AS v,plugin WHERE plugin_id = id ORDER BY v.created desc"
+#define SQL_GET_ALL "SELECT plugin_id,v.created,version,type,author,downloads,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,published,comment,status,plugin.betasecret,intver,intminver,IFNULL(arch,''),IFNULL(regions,'') FROM version AS v,plugin WHERE plugin_id = id ORDER BY BINARY plugin_id, intver DESC, v.created"
 
 #define SQL_CHECK_VERSION "SELECT created FROM version WHERE plugin_id = ? AND version = ?"
 
-#define SQL_INSERT_VERSION "INSERT INTO version (plugin_id,version,type,author,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,comment,status) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)"
+#define SQL_INSERT_VERSION "INSERT INTO version (plugin_id,version,type,author,showtime_min_version,title,category,synopsis,description,homepage,pkg_digest,icon_digest,comment,status,intver,intminver,arch,regions) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)"
+
+#define SQL_GET_UNINDEXED_VERSIONS "SELECT plugin_id,version,showtime_min_version FROM version WHERE intver IS NULL OR intminver IS NULL"
+
+#define SQL_SET_VERSION_INTS "UPDATE version SET intver=?, intminver=? WHERE plugin_id=? AND version=?"
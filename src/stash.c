@@ -2,10 +2,12 @@
 #include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -19,60 +21,388 @@
 #include "libsvc/db.h"
 
 #include "stash.h"
+#include "downloads.h"
+#include "blobcache.h"
+#include "fdcache.h"
+#include "stashindex.h"
 
-int
-stash_write(const void *data, size_t size, char digest[41])
+#define STASH_WRITER_BUFSIZE 65536
+
+struct stash_writer {
+  SHA_CTX ctx;
+  int fd;
+  int error;
+  size_t used;
+  int64_t total;
+  char tmppath[PATH_MAX];
+  char stashdir[PATH_MAX];
+  uint8_t buf[STASH_WRITER_BUFSIZE];
+};
+
+
+/**
+ * Start writing a new object. Data is written to a temporary file in
+ * the stash directory and only becomes visible under its digest once
+ * stash_writer_commit() succeeds
+ */
+stash_writer_t *
+stash_writer_open(void)
 {
   cfg_root(root);
   const char *stashdir = cfg_get_str(root, CFG("stashdir"), NULL);
   if(stashdir == NULL) {
     trace(LOG_ERR, "No stashdir configured, unable to ingest anything");
+    return NULL;
+  }
+
+  if(makedirs(stashdir)) {
+    trace(LOG_ERR, "Unable to mkdir('%s') -- %s", stashdir, strerror(errno));
+    return NULL;
+  }
+
+  stash_writer_t *sw = malloc(sizeof(stash_writer_t));
+  snprintf(sw->stashdir, sizeof(sw->stashdir), "%s", stashdir);
+  snprintf(sw->tmppath, sizeof(sw->tmppath), "%s/.tmp-XXXXXX", stashdir);
+
+  sw->fd = mkstemp(sw->tmppath);
+  if(sw->fd == -1) {
+    trace(LOG_ERR, "Unable to create '%s' -- %s",
+          sw->tmppath, strerror(errno));
+    free(sw);
+    return NULL;
+  }
+
+  SHA1_Init(&sw->ctx);
+  sw->error = 0;
+  sw->used = 0;
+  sw->total = 0;
+  return sw;
+}
+
+
+/**
+ *
+ */
+static int
+stash_writer_flush(stash_writer_t *sw)
+{
+  size_t off = 0;
+
+  while(!sw->error && off < sw->used) {
+    ssize_t r = write(sw->fd, sw->buf + off, sw->used - off);
+    if(r == -1) {
+      if(errno == EINTR)
+        continue;
+      sw->error = errno;
+      trace(LOG_ERR, "Unable to write('%s') -- %s",
+            sw->tmppath, strerror(errno));
+      break;
+    }
+    off += r;
+  }
+  sw->used = 0;
+  return sw->error ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+int
+stash_writer_append(stash_writer_t *sw, const void *data, size_t size)
+{
+  const uint8_t *src = data;
+
+  if(sw->error)
     return -1;
+
+  SHA1_Update(&sw->ctx, data, size);
+  sw->total += size;
+
+  while(size > 0) {
+    const size_t chunk = MIN(size, sizeof(sw->buf) - sw->used);
+    memcpy(sw->buf + sw->used, src, chunk);
+    sw->used += chunk;
+    src += chunk;
+    size -= chunk;
+    if(sw->used == sizeof(sw->buf) && stash_writer_flush(sw))
+      return -1;
   }
+  return 0;
+}
+
+
+/**
+ * Drop a writer without storing anything
+ */
+void
+stash_writer_abort(stash_writer_t *sw)
+{
+  close(sw->fd);
+  unlink(sw->tmppath);
+  free(sw);
+}
+
+
+/**
+ * Durably store the object under its digest. If the object already
+ * exists the new copy is just discarded. The writer is always freed
+ */
+int
+stash_writer_commit(stash_writer_t *sw, char digest[41])
+{
   uint8_t md[20];
   char path[PATH_MAX];
-  SHA1(data, size, md);
+  struct stat st;
+
+  if(stash_writer_flush(sw)) {
+    stash_writer_abort(sw);
+    return -1;
+  }
+
+  SHA1_Final(md, &sw->ctx);
   bin2hex(digest, 41, md, 20);
 
-  snprintf(path, sizeof(path), "%s/%.*s", stashdir, 2, digest);
+  snprintf(path, sizeof(path), "%s/%.*s/%s", sw->stashdir, 2, digest, digest);
+  if(!stat(path, &st)) {
+    // Refresh mtime so GC's grace period covers the object until
+    // whatever is about to reference it has been committed
+    utimensat(AT_FDCWD, path, NULL, 0);
+    stash_index_add(digest, st.st_size, time(NULL));
+    stash_writer_abort(sw);
+    return 0;
+  }
+
+  if(fsync(sw->fd)) {
+    trace(LOG_ERR, "Unable to fsync('%s') -- %s",
+          sw->tmppath, strerror(errno));
+    stash_writer_abort(sw);
+    return -1;
+  }
+
+  fchmod(sw->fd, 0644);
+
+  snprintf(path, sizeof(path), "%s/%.*s", sw->stashdir, 2, digest);
   if(makedirs(path)) {
     trace(LOG_ERR, "Unable to mkdir('%s') -- %s", path, strerror(errno));
+    stash_writer_abort(sw);
     return -1;
   }
 
-  snprintf(path, sizeof(path), "%s/%.*s/%s", stashdir, 2, digest, digest);
+  snprintf(path, sizeof(path), "%s/%.*s/%s", sw->stashdir, 2, digest, digest);
+  if(rename(sw->tmppath, path)) {
+    trace(LOG_ERR, "Unable to rename('%s', '%s') -- %s",
+          sw->tmppath, path, strerror(errno));
+    stash_writer_abort(sw);
+    return -1;
+  }
 
-  int r = writefile(path, data, size);
-  if(r == WRITEFILE_NO_CHANGE)
-    return 0;
-  if(r)
-    trace(LOG_ERR, "Unable to write('%s') -- %s", path, strerror(r));
+  stash_index_add(digest, sw->total, time(NULL));
+
+  // Make the rename itself durable
+  snprintf(path, sizeof(path), "%s/%.*s", sw->stashdir, 2, digest);
+  int r = 0;
+  int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dfd == -1 || fsync(dfd)) {
+    trace(LOG_ERR, "Unable to fsync('%s') -- %s", path, strerror(errno));
+    r = -1;
+  }
+  if(dfd != -1)
+    close(dfd);
+
+  close(sw->fd);
+  free(sw);
   return r;
 }
 
+
+/**
+ *
+ */
+int
+stash_write(const void *data, size_t size, char digest[41])
+{
+  stash_writer_t *sw = stash_writer_open();
+  if(sw == NULL)
+    return -1;
+
+  if(stash_writer_append(sw, data, size)) {
+    stash_writer_abort(sw);
+    return -1;
+  }
+  return stash_writer_commit(sw, digest);
+}
+
+
+/**
+ * Drop all in-memory knowledge of an object that has been removed
+ * from the stash
+ */
+void
+stash_forget(const char *digest)
+{
+  stash_index_remove(digest);
+  blobcache_remove(digest);
+  fdcache_remove(digest);
+}
+
+
 /**
+ * Only a single range is supported. Multiple ranges are answered with
+ * the full object, which RFC 7233 permits.
  *
+ * Returns 0 to send everything, 1 to send [*offp, *offp + *lenp) and
+ * -1 if the range can't be satisfied
  */
 static int
-do_send_file(http_connection_t *hc, const char *ct,
-             int content_len, const char *ce, int fd)
+stash_parse_range(http_connection_t *hc, const char *digest, int64_t size,
+                  int64_t *offp, int64_t *lenp)
 {
-  // Since the filenames are hash of the contents, we can
-  // cache them for a long while
+  const char *range = http_arg_get(&hc->hc_args, "range");
+  if(range == NULL)
+    return 0;
 
-  int r = 0;
+  // Objects never change so a date validator always matches. An
+  // entity tag must be ours though
+  const char *ifrange = http_arg_get(&hc->hc_args, "if-range");
+  if(ifrange != NULL && (*ifrange == '"' || !strncmp(ifrange, "W/", 2))) {
+    if(strlen(ifrange) != 42 || ifrange[41] != '"' ||
+       strncmp(ifrange + 1, digest, 40))
+      return 0;
+  }
 
-  http_send_header(hc, HTTP_STATUS_OK, ct, content_len, ce,
-                   NULL, 86400 * 200, NULL, NULL, NULL);
+  if((range = mystrbegins(range, "bytes=")) == NULL ||
+     strchr(range, ',') != NULL)
+    return 0;
+
+  char *end;
+  int64_t first, last;
+
+  if(*range == '-') {
+    // Suffix range, the last N bytes
+    int64_t n = strtoll(range + 1, &end, 10);
+    if(end == range + 1 || *end)
+      return 0;
+    if(n <= 0 || size == 0)
+      return -1;
+    first = n >= size ? 0 : size - n;
+    last = size - 1;
+  } else {
+    first = strtoll(range, &end, 10);
+    if(end == range || *end != '-' || first < 0)
+      return 0;
+    range = end + 1;
+    if(*range) {
+      last = strtoll(range, &end, 10);
+      if(*end || last < first)
+        return 0;
+    } else {
+      last = size - 1;
+    }
+    if(first >= size)
+      return -1;
+    if(last >= size)
+      last = size - 1;
+  }
+
+  *offp = first;
+  *lenp = last - first + 1;
+  return 1;
+}
 
-  if(!hc->hc_no_output)
-    r = tcp_sendfile(hc->hc_ts, fd, content_len);
 
-  close(fd);
+/**
+ * The fd is checked out for this download only, so its file position
+ * is ours to move and the body can go out with tcp_sendfile()
+ */
+static int
+send_file_range(http_connection_t *hc, stash_file_t *sf, const char *path,
+                int64_t off, int64_t len)
+{
+  int fd = stash_file_checkout(sf, path);
+  if(fd == -1)
+    return -1;
+
+  int r = -1;
+  if(lseek(fd, off, SEEK_SET) == off)
+    r = tcp_sendfile(hc->hc_ts, fd, len) ? -1 : 0;
+
+  stash_file_checkin(sf, fd);
   return r;
 }
 
 
+/**
+ * The URL is the digest of the content so any copy a client has is
+ * current, as long as the object still exists. Revalidation is thus
+ * answered without looking at the object itself
+ */
+static int
+stash_not_modified(http_connection_t *hc, const char *digest)
+{
+  const char *inm = http_arg_get(&hc->hc_args, "if-none-match");
+
+  if(inm != NULL) {
+    // Comma separated list of (possibly weak) entity tags, or '*'
+    while(*inm) {
+      inm += strspn(inm, " \t,");
+      if(!strncmp(inm, "W/", 2))
+        inm += 2;
+      if(*inm == '*')
+        return 1;
+      const int quoted = *inm == '"';
+      const char *tag = inm + quoted;
+      const size_t len = strcspn(tag, quoted ? "\"" : " \t,");
+      if(len == 0 && !quoted) {
+        inm++;
+        continue;
+      }
+      if(len == 40 && !strncmp(tag, digest, 40))
+        return 1;
+      inm = tag + len + (quoted && tag[len]);
+    }
+    // If-Modified-Since must be ignored when If-None-Match is present
+    return 0;
+  }
+
+  return http_arg_get(&hc->hc_args, "if-modified-since") != NULL;
+}
+
+
+/**
+ * HEAD does not need the object itself, only its size
+ */
+static int
+stash_head(http_connection_t *hc, const char *stashdir, const char *digest)
+{
+  char path[PATH_MAX];
+  int64_t size;
+  blob_t *b;
+  stash_file_t *sf;
+
+  if(stash_index_lookup(digest, &size, NULL) == 1) {
+    // Size known from the index
+  } else if((b = blobcache_get(digest, -1)) != NULL) {
+    size = b->size;
+    blob_release(b);
+  } else if((sf = fdcache_get(digest)) != NULL) {
+    size = sf->size;
+    stash_file_release(sf);
+  } else {
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%.2s/%s", stashdir, digest, digest);
+    if(stat(path, &st))
+      return 404;
+    size = st.st_size;
+  }
+
+  http_arg_set(&hc->hc_response_headers, "Accept-Ranges", "bytes");
+  http_send_header(hc, HTTP_STATUS_OK, NULL, size, NULL,
+                   NULL, 86400 * 200, NULL, NULL, NULL);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -92,35 +422,133 @@ send_data(http_connection_t *hc, const char *remain, void *opaque)
     return 500;
 
 
+  const char *ct = NULL;
+  const char *ce = NULL;
+  char etag[43];
+  int r;
+
+  snprintf(etag, sizeof(etag), "\"%s\"", remain);
+  http_arg_set(&hc->hc_response_headers, "ETag", etag);
+
+  // The index is in memory so this is still before any filesystem
+  // access. While it is loading objects are assumed to exist
+  int64_t known_size = -1;
+  if(stash_index_lookup(remain, &known_size, NULL) == 0)
+    return 404;
+
+  if(stash_not_modified(hc, remain))
+    return 304;
+
+  if(hc->hc_cmd == HTTP_CMD_HEAD)
+    return stash_head(hc, stashdir, remain);
+
+  blob_t *b = blobcache_get(remain, known_size);
+  stash_file_t *sf = NULL;
+
   snprintf(path, sizeof(path), "%s/%.2s/%s", stashdir, remain, remain);
 
-  int fd = open(path, O_RDONLY);
-  if(fd == -1) {
-    trace(LOG_INFO, "Missing file '%s' -- %s", path, strerror(errno));
+  if(b == NULL && (sf = fdcache_get(remain)) == NULL) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+      trace(LOG_INFO, "Missing file '%s' -- %s", path, strerror(errno));
+      if(errno == ENOENT)
+        stash_index_remove(remain);
+      return 404;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)) {
+      trace(LOG_INFO, "Stat failed for file '%s'  -- %s",
+            path, strerror(errno));
+      close(fd);
       return 404;
+    }
+
+    // Small objects are kept in memory, bigger ones are sent from disk
+    b = blobcache_load(remain, fd, st.st_size);
+    if(b == NULL) {
+      sf = fdcache_insert(remain, fd, st.st_size);
+    } else {
+      close(fd);
+    }
   }
 
-  struct stat st;
-  if(fstat(fd, &st)) {
-    trace(LOG_INFO, "Stat failed for file '%s'  -- %s",
-          path, strerror(errno));
-    close(fd);
-    return 404;
+  const int64_t size = b != NULL ? b->size : sf->size;
+  int64_t off = 0, len = size;
+  char crange[128];
+
+  const int partial = stash_parse_range(hc, remain, size, &off, &len);
+
+  // For 206 http_send_header() adds this along with Content-Range
+  if(partial == 0)
+    http_arg_set(&hc->hc_response_headers, "Accept-Ranges", "bytes");
+
+  if(partial < 0) {
+    snprintf(crange, sizeof(crange), "bytes */%"PRId64, size);
+    http_arg_set(&hc->hc_response_headers, "Content-Range", crange);
+    r = 416;
+  } else {
+    // Since the filenames are hash of the contents, we can
+    // cache them for a long while
+    if(partial)
+      snprintf(crange, sizeof(crange), "bytes %"PRId64"-%"PRId64"/%"PRId64,
+               off, off + len - 1, size);
+
+    http_send_header(hc, partial ? HTTP_STATUS_PARTIAL_CONTENT :
+                     HTTP_STATUS_OK, ct, len, ce,
+                     NULL, 86400 * 200, partial ? crange : NULL, NULL, NULL);
+
+    if(hc->hc_no_output)
+      r = 0;
+    else if(b != NULL)
+      r = tcp_write(hc->hc_ts, b->data + off, len) ? -1 : 0;
+    else
+      r = send_file_range(hc, sf, path, off, len);
   }
 
-  const char *ct = NULL;
-  const char *ce = NULL;
+  if(b != NULL)
+    blob_release(b);
+  if(sf != NULL)
+    stash_file_release(sf);
 
-  int content_len = st.st_size;
+  // Resumed downloads are only counted once
+  if(r == 0 && off == 0)
+    downloads_inc(remain);
+  return r;
+}
 
-  if(do_send_file(hc, ct, content_len, ce, fd))
-    return -1;
 
-  db_conn_t *c = db_get_conn();
-  if(c != NULL)
-    db_stmt_exec(db_stmt_get(c, "UPDATE version SET downloads = downloads + 1 WHERE pkg_digest=?"), "s", remain);
+/**
+ * Writers that were interrupted by a crash leave their temporary files
+ * behind. Must be called before anything that can ingest (ctrlsock,
+ * HTTP, ingest workers) is started
+ */
+void
+stash_remove_tmpfiles(void)
+{
+  char path[PATH_MAX];
+  struct dirent *de;
 
-  return 0;
+  cfg_root(root);
+  const char *stashdir = cfg_get_str(root, CFG("stashdir"), NULL);
+  if(stashdir == NULL)
+    return;
+
+  DIR *d = opendir(stashdir);
+  if(d == NULL)
+    return;
+
+  while((de = readdir(d)) != NULL) {
+    if(strncmp(de->d_name, ".tmp-", 5))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", stashdir, de->d_name);
+    if(unlink(path))
+      trace(LOG_ERR, "Unable to remove '%s' -- %s", path, strerror(errno));
+    else
+      trace(LOG_INFO, "Removed stale temporary file '%s'", path);
+  }
+  closedir(d);
 }
 
 
@@ -130,5 +558,9 @@ send_data(http_connection_t *hc, const char *remain, void *opaque)
 void
 stash_init(void)
 {
+  cfg_root(root);
+
+  stash_index_init(cfg_get_str(root, CFG("stashdir"), NULL));
+
   http_path_add("/public/data",  NULL, send_data);
 }
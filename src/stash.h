@@ -1,5 +1,18 @@
+typedef struct stash_writer stash_writer_t;
+
+stash_writer_t *stash_writer_open(void);
+
+int stash_writer_append(stash_writer_t *sw, const void *data, size_t size);
+
+int stash_writer_commit(stash_writer_t *sw, char digest[41]);
+
+void stash_writer_abort(stash_writer_t *sw);
 
 int stash_write(const void *data, size_t size, char digest[41]);
 
+void stash_forget(const char *digest);
+
+void stash_remove_tmpfiles(void);
+
 void stash_init(void);
 
@@ -0,0 +1,349 @@
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/cmd.h"
+
+#include "stashindex.h"
+#include "spmc.h"
+
+/**
+ * Digest -> size/mtime of everything in the stash. Sharded on the
+ * first digest byte, same as the <xx> directories, so each scanner
+ * thread fills its own shard
+ */
+#define STASH_INDEX_SHARDS 256
+
+LIST_HEAD(stash_entry_list, stash_entry);
+
+typedef struct stash_entry {
+  LIST_ENTRY(stash_entry) link;
+  uint8_t digest[20];
+  int64_t size;
+  time_t mtime;
+} stash_entry_t;
+
+typedef struct stash_shard {
+  pthread_mutex_t mutex;
+  struct stash_entry_list *buckets;
+  unsigned int num_buckets;
+  unsigned int count;
+  int64_t bytes;
+} stash_shard_t;
+
+static stash_shard_t stash_shards[STASH_INDEX_SHARDS];
+
+// Set once the startup scan is complete. Until then a miss in the
+// index does not mean the object is missing
+static int stash_index_ready;
+
+static char *stash_index_dir;
+static int stash_index_next_shard;
+
+
+/**
+ *
+ */
+static unsigned int
+digest_bucket(const uint8_t digest[20], unsigned int num_buckets)
+{
+  // The digest is uniformly distributed already, byte 0 picked the shard
+  uint32_t h;
+  memcpy(&h, digest + 1, 4);
+  return h & (num_buckets - 1);
+}
+
+
+/**
+ *
+ */
+static stash_entry_t *
+shard_find(stash_shard_t *ss, const uint8_t digest[20])
+{
+  stash_entry_t *se;
+
+  if(ss->num_buckets == 0)
+    return NULL;
+
+  LIST_FOREACH(se, &ss->buckets[digest_bucket(digest, ss->num_buckets)], link)
+    if(!memcmp(se->digest, digest, 20))
+      return se;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+shard_grow(stash_shard_t *ss)
+{
+  const unsigned int n = ss->num_buckets ? ss->num_buckets * 2 : 16;
+  struct stash_entry_list *buckets = calloc(n, sizeof(*buckets));
+  stash_entry_t *se;
+
+  for(unsigned int i = 0; i < ss->num_buckets; i++) {
+    while((se = LIST_FIRST(&ss->buckets[i])) != NULL) {
+      LIST_REMOVE(se, link);
+      LIST_INSERT_HEAD(&buckets[digest_bucket(se->digest, n)], se, link);
+    }
+  }
+  free(ss->buckets);
+  ss->buckets = buckets;
+  ss->num_buckets = n;
+}
+
+
+/**
+ *
+ */
+static void
+shard_add(stash_shard_t *ss, const uint8_t digest[20],
+          int64_t size, time_t mtime)
+{
+  pthread_mutex_lock(&ss->mutex);
+
+  stash_entry_t *se = shard_find(ss, digest);
+  if(se == NULL) {
+    if(ss->count >= ss->num_buckets * 2)
+      shard_grow(ss);
+    se = malloc(sizeof(stash_entry_t));
+    memcpy(se->digest, digest, 20);
+    se->size = 0;
+    LIST_INSERT_HEAD(&ss->buckets[digest_bucket(digest, ss->num_buckets)],
+                     se, link);
+    ss->count++;
+  }
+  ss->bytes += size - se->size;
+  se->size = size;
+  se->mtime = mtime;
+
+  pthread_mutex_unlock(&ss->mutex);
+}
+
+
+/**
+ * Returns 1 if the object exists, 0 if it does not and -1 if the index
+ * can't tell yet
+ */
+int
+stash_index_lookup(const char *digest, int64_t *sizep, time_t *mtimep)
+{
+  uint8_t d[20];
+
+  if(digest_parse(d, digest))
+    return 0;
+
+  stash_shard_t *ss = &stash_shards[d[0]];
+  int r;
+
+  pthread_mutex_lock(&ss->mutex);
+  stash_entry_t *se = shard_find(ss, d);
+  if(se != NULL) {
+    if(sizep != NULL)
+      *sizep = se->size;
+    if(mtimep != NULL)
+      *mtimep = se->mtime;
+    r = 1;
+  } else {
+    r = __atomic_load_n(&stash_index_ready, __ATOMIC_ACQUIRE) ? 0 : -1;
+  }
+  pthread_mutex_unlock(&ss->mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+stash_index_add(const char *digest, int64_t size, time_t mtime)
+{
+  uint8_t d[20];
+  if(digest_parse(d, digest))
+    return;
+  shard_add(&stash_shards[d[0]], d, size, mtime);
+}
+
+
+/**
+ *
+ */
+void
+stash_index_remove(const char *digest)
+{
+  uint8_t d[20];
+  if(digest_parse(d, digest))
+    return;
+
+  stash_shard_t *ss = &stash_shards[d[0]];
+  pthread_mutex_lock(&ss->mutex);
+  stash_entry_t *se = shard_find(ss, d);
+  if(se != NULL) {
+    LIST_REMOVE(se, link);
+    ss->count--;
+    ss->bytes -= se->size;
+    free(se);
+  }
+  pthread_mutex_unlock(&ss->mutex);
+}
+
+
+/**
+ *
+ */
+static void
+stash_index_scan_shard(int shard)
+{
+  char path[PATH_MAX];
+  uint8_t d[20];
+  struct dirent *de;
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%02x", stash_index_dir, shard);
+  DIR *dir = opendir(path);
+  if(dir == NULL) {
+    if(errno != ENOENT)
+      trace(LOG_ERR, "Unable to scan %s -- %s", path, strerror(errno));
+    return;
+  }
+
+  while((de = readdir(dir)) != NULL) {
+    if(digest_parse(d, de->d_name) || d[0] != shard)
+      continue;
+    if(fstatat(dirfd(dir), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+      continue;
+    shard_add(&stash_shards[shard], d, st.st_size, st.st_mtime);
+  }
+  closedir(dir);
+}
+
+
+/**
+ *
+ */
+static void *
+stash_index_scan_thread(void *aux)
+{
+  int shard;
+  while((shard = __sync_fetch_and_add(&stash_index_next_shard, 1)) <
+        STASH_INDEX_SHARDS)
+    stash_index_scan_shard(shard);
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+stash_index_totals(unsigned int *countp, int64_t *bytesp)
+{
+  unsigned int count = 0;
+  int64_t bytes = 0;
+
+  for(int i = 0; i < STASH_INDEX_SHARDS; i++) {
+    stash_shard_t *ss = &stash_shards[i];
+    pthread_mutex_lock(&ss->mutex);
+    count += ss->count;
+    bytes += ss->bytes;
+    pthread_mutex_unlock(&ss->mutex);
+  }
+  *countp = count;
+  *bytesp = bytes;
+}
+
+
+/**
+ *
+ */
+static void *
+stash_index_build_thread(void *aux)
+{
+  cfg_root(root);
+  int nthreads = cfg_get_int(root, CFG("stash", "scanthreads"), 4);
+  if(nthreads < 1)
+    nthreads = 1;
+
+  pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+  const time_t start = time(NULL);
+
+  for(int i = 0; i < nthreads; i++)
+    pthread_create(&tids[i], NULL, stash_index_scan_thread, NULL);
+  for(int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  __atomic_store_n(&stash_index_ready, 1, __ATOMIC_RELEASE);
+
+  unsigned int count;
+  int64_t bytes;
+  stash_index_totals(&count, &bytes);
+  trace(LOG_INFO, "Stash index built in %ds, %u objects, %"PRId64" bytes",
+        (int)(time(NULL) - start), count, bytes);
+  return NULL;
+}
+
+
+/**
+ * Scan the stash in the background. Lookups fall back to the
+ * filesystem until the scan has completed
+ */
+void
+stash_index_init(const char *stashdir)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  for(int i = 0; i < STASH_INDEX_SHARDS; i++)
+    pthread_mutex_init(&stash_shards[i].mutex, NULL);
+
+  if(stashdir == NULL)
+    return;
+
+  stash_index_dir = strdup(stashdir);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, stash_index_build_thread, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+/**
+ *
+ */
+static int
+show_stash_index(const char *user,
+                 int argc, const char **argv, int *intv,
+                 void (*msg)(void *opaque, const char *fmt, ...),
+                 void *opaque)
+{
+  unsigned int count;
+  int64_t bytes;
+
+  stash_index_totals(&count, &bytes);
+  msg(opaque, "%u objects, %"PRId64" bytes%s", count, bytes,
+      __atomic_load_n(&stash_index_ready, __ATOMIC_ACQUIRE) ?
+      "" : " (scan in progress)");
+  return 0;
+}
+
+CMD(show_stash_index,
+    CMD_LITERAL("show"),
+    CMD_LITERAL("stash"),
+    CMD_LITERAL("index")
+    );
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+void stash_index_init(const char *stashdir);
+
+int stash_index_lookup(const char *digest, int64_t *sizep, time_t *mtimep);
+
+void stash_index_add(const char *digest, int64_t size, time_t mtime);
+
+void stash_index_remove(const char *digest);